@@ -7,15 +7,41 @@
 #include <cstdint>
 #include <cstring>
 #include <map>
+#include <set>
 #include <stack>
+#include <string_view>
 #include <filesystem>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <condition_variable>
+#include <shared_mutex>
+#include <sys/mman.h>
 
 #include "utils.h"
+#include "page_pool.h"
+#include "compress.h"
+#include "page_cache.h"
+#include "vfs.h"
+#include "compressed_vfs.h"
+#include "uring.h"
+#include "wal.h"
+#include "freelist.h"
 
 using PrintCellFunc = void(*)(uint16_t);
+static const uint32_t DEFAULT_PAGE_SIZE = 4096; // for new databases
+static const uint32_t DB_HEADER_SIZE = 100; // at the start of page 1
+static const int32_t DEFAULT_CACHE_SIZE = -2000; // same meaning as PRAGMA cache_size: negative is KiB, positive is pages
+static const uint32_t IO_URING_DEPTH = 128; // page reads in flight at most
+static const uint32_t BACKUP_RUN_PAGES = 64; // consecutive pages a backup reads at once
+static const int BACKUP_MAX_PASSES = 4; // the last pass of a finishing backup holds commits off
+static const uint32_t VACUUM_RUN_PAGES = 64; // pages VACUUM writes at once
+static const char VACUUM_MAGIC[] = "vacuumed"; // starts the footer of a complete fn-vacuum image
+static const uint32_t BULK_LOAD_RUN_PAGES = 256; // pages the bulk loader writes at once
 struct BTreePage;
 struct DB;
 struct Payload;
+struct PayloadView;
 
 enum class BTreePageType : uint8_t {
     InteriorIndexBTreePage = 0x02,
@@ -29,6 +55,7 @@ enum class ReturnCodes {
     CellFound,
     CellNotFound,
     CellInserted,
+    CellDeleted,
     NotEnoughSpaceToInsert,
     RowidAlreadyInDatabase,
     BadSearch,
@@ -66,6 +93,14 @@ static std::map<std::string, ColumnAffinity>AFFINITY{
     {"REAL", ColumnAffinity::REAL}
 };
 
+// without a rollback journal only WAL mode makes a commit atomic, outside it a crash
+// mid-commit leaves some of the new pages in the file whatever the level
+enum class Synchronous {
+    Off,    // never fsync
+    Normal, // fsync once per commit, in WAL mode only at checkpoint
+    Full    // fsync every commit, data pages before the header page
+};
+
 enum class ColumnType {
     NULL_,
     INT8,
@@ -87,7 +122,7 @@ struct BTreePage {
         BTreePageType page_type;
         uint16_t first_free_block;
         uint16_t num_of_cells;
-        uint16_t start_of_cell_content_area;
+        uint32_t start_of_cell_content_area; // 65536 is stored as 0
         uint8_t num_of_fragmented_free_bytes_in_cell_content;
         uint32_t right_most_pointer;
     };
@@ -118,27 +153,36 @@ struct BTreePage {
     }
 
     BTreePageType get_page_type(uint8_t page_type);
-    uint16_t compute_directly_stored_payload_size(uint64_t P);
-    uint16_t compute_free_space();
-    uint16_t compute_cell_size(uint64_t id, uint64_t P = 0);
+    uint32_t compute_directly_stored_payload_size(uint64_t P);
+    uint32_t compute_free_space();
+    uint32_t compute_unused_space();
+    bool is_underfull();
+    uint32_t compute_cell_size(uint64_t id, uint64_t P = 0);
     uint64_t get_cell_rowid(uint16_t offset);
     uint64_t get_cell_payload_size(uint16_t offset);
     uint32_t get_cell_left_child_pointer(uint16_t offset);
     uint32_t get_cell_first_overflow_page(uint16_t offset);
+    uint32_t get_cell_size(uint16_t offset);
     uint8_t get_header_size();
     uint32_t get_right_most_pointer();
     uint16_t lower_bound(uint64_t id);
     bool compare_rowid(uint16_t idx, uint64_t id);
-    uint16_t min_payload();
-    uint16_t max_payload();
-    uint16_t get_split_index(uint16_t idx, uint16_t* sums, uint16_t* cell_sizes, uint16_t* cell_content_offsets);
+    uint32_t min_payload();
+    uint32_t max_payload();
     void read_cell(uint16_t offset, Payload* p);
+    void read_cell(uint16_t offset, PayloadView* v);
+    void prefetch_children();
+    void prefetch_overflow();
 
     ReturnCodes insert_leaf_cell(uint64_t id, uint16_t cell_offsets_idx, Payload* payload);
     ReturnCodes insert_interior_cell(uint64_t id, uint16_t cell_offsets_idx, uint32_t left_child_pointer);
+    void drop_cell(uint16_t idx);
+    void free_space(uint32_t offset, uint32_t size);
+    uint16_t allocate_space(uint32_t size);
+    void defragment();
     void shift_cell_offsets_array(uint16_t idx);
     void write_num_of_cells() { write_big_endian16(header.num_of_cells, bytes + 1 + 2); } //uint16_t check; read_big_endian16(&check, bytes + 1 + 2); std::cout << "num_of_cells: " << check; }
-    void write_start_of_cell_content_area() { write_big_endian16(header.start_of_cell_content_area, bytes + 1 + 2 + 2); } // uint16_t check; read_big_endian16(&check, bytes + 1 + 2 + 2); std::cout << "start_of_cell_content_area: " << check; }//
+    void write_start_of_cell_content_area() { write_big_endian16(static_cast<uint16_t>(header.start_of_cell_content_area), bytes + 1 + 2 + 2); } // uint16_t check; read_big_endian16(&check, bytes + 1 + 2 + 2); std::cout << "start_of_cell_content_area: " << check; }//
     void write_header();
 
     void info();
@@ -163,20 +207,37 @@ struct Payload {
     void recreate(uint64_t P, uint64_t rowid);
     uint64_t get_bytes_in_header(std::string& map);
     uint64_t get_payload_size(std::string& map);
-    uint64_t get_column_content_size(uint64_t serial_type);
-    ColumnType get_column_type(uint64_t serial_type);
+    static uint64_t get_column_content_size(uint64_t serial_type);
+    static ColumnType get_column_type(uint64_t serial_type);
     std::string get_text_column(uint16_t column_idx);
     int64_t get_integer_column(uint16_t column_idx);
     double get_real_column(uint16_t column_idx);
     void info();
     void print();
-    uint64_t print_serial_type_description(uint64_t serial_type);
+    static uint64_t print_serial_type_description(uint64_t serial_type);
+};
+
+// Record without its own copy of the bytes
+// Points into the page buffer of the BTreePage it was read from when the whole payload is on the page,
+// valid until that page is recreated; rows with overflow pages are materialized into overflow
+struct PayloadView {
+    uint64_t P = 0;
+    const uint8_t* bytes = nullptr;
+    uint64_t rowid = 0;
+    Payload overflow;
+
+    PayloadView() { }
+    PayloadView(const Payload& p): P(p.P), bytes(p.bytes), rowid(p.rowid) { }
+    bool find_column(uint16_t column_idx, uint64_t* content_offset, uint64_t* content_size);
+    std::string_view get_text_column(uint16_t column_idx);
+    int64_t get_integer_column(uint16_t column_idx);
+    void print();
 };
 
 struct DB {
     struct Header {
         uint8_t header_string[16];
-        uint16_t page_size;
+        uint32_t page_size; // 65536 is stored as 1
         uint8_t file_format_write_version;
         uint8_t file_format_read_version;
         uint8_t unused_reserved_space;
@@ -205,53 +266,347 @@ struct DB {
         std::map<std::string, uint16_t> columns;
         std::vector<ColumnAffinity> columns_affinity;
     };
+    struct IndexSchema {
+        uint32_t root_pg_n;
+        std::string table_name;
+    };
 
-    std::fstream file;
+    std::string fn;
+    std::unique_ptr<Vfs> own_vfs; // private MemoryVfs of a ":memory:" database
+    Vfs* vfs;
+    std::unique_ptr<VfsFile> file;
     Header header;
     std::map<std::string, TableSchema> tables;
+    std::map<std::string, IndexSchema> indexes; // by name, nothing writes to index b-trees, integrity_check reads them
+    PagePool pool; // declared before cache, frames go back to it when the cache is destroyed
+    PageCache cache;
+    std::mutex cache_mutex; // guards cache and map_pins, pages may be pinned from several threads
+
+    Wal wal; // open only in WAL mode
+    FreeList freelist;
+    Synchronous synchronous = Synchronous::Normal;
+    bool in_transaction = false;
+    uint32_t transaction_size_in_pages = 0; // page count to restore on rollback
+    uint8_t* map = nullptr; // read-only shared mapping of the whole file, nullptr when mmap mode is off
+    size_t map_size = 0;
+    uint32_t map_pins = 0;
+
+    // io_uring backend, guarded by cache_mutex like the cache
+    // reads land in their own buffers and go to the page cache once completed
+    struct InFlightRead {
+        uint8_t* bytes;
+        bool stale; // page was written meanwhile, completed bytes are thrown away
+    };
+    Uring ring;
+    std::unordered_map<uint32_t, InFlightRead> in_flight;
+
+    // interior levels of pinned tables kept decoded, find walks them without reading a page
+    // a write to any of their pages or to the root marks the tree stale, the next find decodes it again
+    struct ResidentNode {
+        std::vector<uint64_t> keys;
+        std::vector<uint32_t> children; // keys.size() + 1, the right-most pointer last
+    };
+    struct ResidentTree {
+        std::unordered_map<uint32_t, ResidentNode> nodes;
+        bool stale = true;
+    };
+    std::map<uint32_t, ResidentTree> resident; // by root page
+    std::shared_mutex resident_mutex;
+
+    // right-most leaf of each table as the last insert left it, a rowid past its last one goes straight there
+    // only insert keeps these up to date, rollback, vacuum and bulk loads drop them
+    struct RightmostLeaf {
+        uint32_t pg_n;
+        uint64_t max_rowid;
+    };
+    std::map<uint32_t, RightmostLeaf> rightmost_leaves; // by root page
+
+    // pages committed since the last backup started, tracked from the first backup on, guarded by cache_mutex
+    // the target the last finished backup wrote, still holding backup_base_header, needs only these pages to catch up
+    std::set<uint32_t> backup_changed;
+    bool backup_tracking = false;
+    bool backup_base_valid = false;
+    std::string backup_base_fn;
+    Vfs* backup_base_vfs = nullptr;
+    std::vector<uint8_t> backup_base_header; // of page 1 as that backup wrote it
 
     DB(std::string& fn);
+    DB(std::string& fn, Vfs* vfs);
+    ~DB();
 
     bool check_inheader_dbsize();
-    bool check_split_is_enough(uint16_t split_idx, uint16_t num_of_cells, uint16_t* sums);
     uint32_t compute_database_size_in_pages();
-    uint16_t get_page_size();
-    uint16_t get_U();
+    uint32_t allocate_page();
+    uint32_t allocate_pages(uint32_t n_pages);
+    void free_page(uint32_t pg_n);
+    void load_freelist();
+    void write_freelist();
+    uint32_t get_page_size();
+    uint32_t get_U();
+    uint32_t get_lock_byte_pg_n();
+    void set_cache_size(int32_t cache_size);
+    void set_compressed_cache_size(int32_t cache_size);
+    const uint8_t* pin_page(uint32_t pg_n, bool* mapped);
+    void unpin_page(uint32_t pg_n, bool mapped);
+    void read_page(uint32_t pg_n, uint8_t* bytes);
+    uint32_t read_overflow_run(uint32_t pg_n, uint64_t n_bytes, uint8_t* payload, uint32_t* next_pg_n);
+    void prefetch(uint32_t pg_n, uint32_t n_pages);
+    void prefetch_pages(std::vector<uint32_t>& pages);
+    bool set_mmap(bool enabled);
+    bool remap();
+    bool set_io_uring(bool enabled);
+    bool queue_read(uint32_t pg_n);
+    void reap_reads(uint32_t wait_pg_n);
+    bool set_wal(bool enabled);
+    bool checkpoint();
+    bool checkpoint_frames();
+    void execute(const std::string& sql);
+    bool begin();
+    bool commit();
+    void rollback();
     uint32_t get_root_page_number(std::string& table_name);
     void parse_schema();
     void parse_create_table_sql(const std::string& sql);
     void parse_select_sql(const std::string& sql);
     void parse_insert_sql(const std::string& sql);
+    void parse_delete_sql(const std::string& sql);
     ReturnCodes find(uint32_t root_pg_n, uint64_t id, Payload* p);
+    bool set_resident(const std::string& table_name, bool enabled);
+    void load_resident(uint32_t root_pg_n, ResidentTree& tree);
+    uint32_t find_resident(uint32_t root_pg_n, uint64_t id);
+    void invalidate_resident(uint32_t pg_n);
 
     void write(uint32_t pg_n, uint8_t* bytes);
     ReturnCodes insert(uint32_t root_pg_n, uint64_t id, Payload* payload);
+    ReturnCodes remove(uint32_t root_pg_n, uint64_t id);
+    void remove_range(uint32_t root_pg_n, uint64_t low, uint64_t high);
+    bool clear_range(uint32_t pg_n, uint64_t low, uint64_t high);
+    void settle_range(uint32_t root_pg_n, uint64_t id);
+    void free_subtree(uint32_t pg_n);
+    void free_overflow(uint32_t pg_n, uint64_t n_bytes);
 
     void read_header();
+    bool create_database(uint32_t page_size);
     void print_schema_format_description(int format);
     void print_encoding(int num);
     void print_header();
     void print_tree(uint32_t root_pg_n);
+    std::vector<std::string> integrity_check(unsigned n_threads = 0, size_t max_errors = 100);
+    bool backup(const std::string& target_fn, bool incremental = true, Vfs* target_vfs = nullptr);
+    bool vacuum();
 };
 
 struct Parser {
     Lexer& lex;
     DB* db;
-    Payload* p;
+    PayloadView* p;
     std::string& table_name;
 
     bool match(Tag expected);
     void error(const std::string& message);
-    bool parse_where(Payload* p);
+    bool parse_where(PayloadView* p);
     bool parse_values(Payload* p);
     bool parse_or();
     bool parse_and();
     bool parse_comparison();
+    bool parse_rowid_range(uint64_t* low, uint64_t* high);
     void restart(size_t i = 0);
 
     Parser(Lexer& lex, DB* db, std::string& table_name);
 };
 
+// Walks every table b-tree and the freelist and collects what is wrong with them
+// Subtrees are handed out as tasks, a worker keeps descending by itself once there is enough work queued
+// for the others, so threads read different parts of the file without talking to each other
+struct IntegrityCheck {
+    struct Task {
+        uint32_t pg_n;
+        uint32_t tree; // index into leaf_depth
+        uint32_t depth;
+        bool has_lower;
+        bool has_upper;
+        int64_t lower; // rowids of the subtree are > lower
+        int64_t upper; // and <= upper
+    };
+
+    DB* db;
+    unsigned n_threads;
+    size_t max_errors;
+    std::vector<std::string> errors;
+    std::vector<Task> tasks;
+    unsigned n_busy = 0;
+    std::mutex mutex; // guards errors, tasks and n_busy
+    std::condition_variable cv;
+    std::atomic<bool> stop{false};
+    std::vector<std::atomic<uint8_t>> seen; // referenced from a tree or the freelist already
+    std::vector<std::atomic<int32_t>> leaf_depth; // per tree, -1 until its first leaf
+
+    IntegrityCheck(DB* db, unsigned n_threads, size_t max_errors);
+    std::vector<std::string> run();
+    void error(const std::string& message);
+    bool mark(uint32_t pg_n, uint32_t from_pg_n);
+    void worker();
+    void check_page(const Task& task);
+    void check_overflow(uint32_t pg_n, uint32_t cell_pg_n, uint64_t n_bytes);
+    void check_freelist();
+};
+
+// Online copy of the database into another file, step copies a few pages and lets everybody else go on
+// Pages are read as last committed, straight from the file or the log under cache_mutex, so an open
+// transaction neither blocks the backup nor leaks into it; pages committed meanwhile are copied again
+// The target is a consistent database only after finish returned true, one backup of a database at a time
+struct Backup {
+    DB* db;
+    std::unique_ptr<VfsFile> target;
+    std::string target_fn;
+    Vfs* target_vfs;
+    std::set<uint32_t> pending;
+    std::vector<uint8_t> buffer;
+    std::vector<uint8_t> first_page; // page 1 as last copied
+    bool incremental = false;
+    bool failed = false;
+
+    Backup(DB* db, const std::string& target_fn, bool incremental = true, Vfs* target_vfs = nullptr);
+    int64_t step(uint32_t n_pages); // pages left, -1 on error
+    int64_t copy(uint32_t n_pages, bool locked);
+    bool finish();
+    void take_changed(bool locked);
+    void read_committed(uint32_t pg_n, uint32_t n_pages, uint8_t* bytes);
+};
+
+// Rewrites the file so every b-tree sits in one run of pages: all roots right after page 1, then tree by tree
+// the interior pages level by level and the leaves in key order, each page followed by its overflow chains
+// Free pages are left out and the file shrinks. Page contents stay as they are, only page numbers change,
+// the root pages in sqlite_master are patched in place with their serial types kept
+// The new image is built in fn-vacuum and copied over the database once complete: a footer synced after the
+// image marks it so, and an open which finds a marked image left behind by a crash finishes the copy
+struct Vacuum {
+    enum class Kind : uint8_t {
+        BTree,
+        Schema, // sqlite_master pages, their records hold root page numbers
+        Overflow,
+        LockByte // left empty
+    };
+
+    DB* db;
+    uint32_t n_pages = 0;
+    std::vector<uint32_t> new_pg_n; // by old page, 0 for pages left out
+    std::vector<uint32_t> old_pg_n; // by new page
+    std::vector<Kind> kinds;        // by new page
+    std::vector<uint32_t> roots;
+    bool ok = true;
+
+    Vacuum(DB* db): db(db) { }
+    bool run();
+    void collect_roots();
+    void place(uint32_t pg_n, Kind kind);
+    void place_tree(uint32_t root_pg_n, Kind kind);
+    void place_overflow(BTreePage& page);
+    uint32_t get_overflow_offset(BTreePage& page, uint16_t offset, uint64_t* n_bytes);
+    uint32_t renumber(uint32_t pg_n) { return pg_n < new_pg_n.size() ? new_pg_n[pg_n] : 0; }
+    void relink(uint32_t pg_n, BTreePage& page, uint8_t* bytes);
+    bool write_footer(VfsFile& temp);
+    bool read_footer(VfsFile& temp, uint32_t* image_n_pages, uint32_t* page_size);
+    bool copy_back(VfsFile& temp, uint32_t image_n_pages, uint32_t page_size);
+    bool recover();
+};
+
+// Fills an empty table from rows given in increasing rowid order without going through insert
+// Leaves are packed up to fill_factor of the page and written once full, each full page hands its
+// last rowid to the interior level above, which fills and closes the same way; finish writes the top page to the root
+// Every page gets the next number at the end of the file when it is done, so the file is written strictly in order,
+// overflow pages right before their leaf. Pages bypass the page cache and go to the file in runs, the root goes
+// through the cache and the commit, so nothing loaded is visible before finish
+struct BulkLoader {
+    struct Level {
+        BTreePage page;
+        uint32_t n_closed = 0;
+        uint32_t pending_pg_n = 0; // newest child, not a cell yet, the right-most pointer if the page closes now
+        uint64_t pending_rowid = 0;
+        // the page closed last, written only once page has a cell, an interior page can't be left with none
+        BTreePage held;
+        bool has_held = false;
+        uint64_t held_rowid = 0;
+
+        Level(DB* db, BTreePageType page_type): page(db, page_type), held(db, page_type) { }
+    };
+
+    DB* db;
+    uint32_t root_pg_n = 0;
+    double fill_factor;
+    std::vector<std::unique_ptr<Level>> levels; // leaves first
+    uint64_t last_rowid = 0;
+    uint64_t n_rows = 0;
+    std::vector<uint8_t> run;
+    uint32_t run_first_pg_n = 0;
+    uint32_t run_n_pages = 0;
+    bool own_transaction = false;
+    bool failed = false;
+    bool finished = false;
+
+    BulkLoader(DB* db, const std::string& table_name, double fill_factor = 1.0);
+    ~BulkLoader();
+    bool add(Payload* payload);
+    bool finish();
+    bool fits(BTreePage& page, uint32_t cell_size);
+    void reset(BTreePage& page);
+    uint32_t append(const uint8_t* bytes);
+    bool flush();
+    void close_leaf();
+    void add_child(size_t level, uint32_t pg_n, uint64_t rowid);
+    void close_interior(size_t level);
+    void write_held(size_t level);
+    void settle_held(size_t level);
+};
+
+// Settles a b-tree page which got more cells than fit, the way SQLite's balance_nonroot does
+// The page and up to two siblings next to it are taken apart, their cells and the dividers between them
+// are dealt out again over as many pages as it takes, left to right as full as they go, then evened out
+// from the right. The parent gets the new dividers and is settled the same way when they don't fit
+// A root which doesn't fit moves down into a new child first, so the tree grows at the top at any depth
+// Appends past the last rowid of the table split nothing: the new cell starts a leaf of its own and full
+// pages stay full on every level, so sequential inserts leave the tree packed
+// After a delete shrink deals a page less than a third full out with its siblings the same way, which merges
+// them when they fit on fewer pages, and goes on with the parent as long as that is left underfull too
+struct Balancer {
+    struct Level {
+        uint32_t pg_n;
+        uint16_t idx; // child taken on the way down, num_of_cells for the right-most pointer
+    };
+
+    // copies of cells, cell i is bytes[offsets[i], offsets[i + 1])
+    struct Cells {
+        std::vector<uint8_t> bytes;
+        std::vector<uint32_t> offsets{0};
+
+        size_t size() { return offsets.size() - 1; }
+        uint8_t* get(size_t i) { return bytes.data() + offsets[i]; }
+        uint32_t get_size(size_t i) { return offsets[i + 1] - offsets[i]; }
+        uint64_t get_leaf_rowid(size_t i);
+        void add(const uint8_t* cell, uint32_t n);
+        void add(uint32_t left_child_pointer, const uint8_t* cell, uint32_t n);
+        void add_page(BTreePage& page, uint16_t from, uint16_t to);
+    };
+
+    DB* db;
+    std::vector<Level> path; // root first, the page to settle last
+    BTreePageType page_type; // of the page to settle
+    Cells cells;             // everything the page to settle has to hold
+    uint32_t right_most_pointer = 0;
+    bool append = false;            // the new cell is the last one of the right-most leaf
+    uint32_t rightmost_leaf_pg_n = 0; // where an append left the right-most leaf
+
+    Balancer(DB* db, std::vector<Level>& path, BTreePageType page_type): db(db), path(path), page_type(page_type) { }
+    void run();
+    void deepen_root();
+    bool balance(size_t depth);
+    bool balance_quick(size_t depth);
+    void shrink();
+    void make_shallower();
+    bool settle_parent(size_t depth, BTreePage& parent, Cells& upper, uint32_t parent_right_most);
+    void fill(BTreePage& page, Cells& from, size_t first, size_t last, uint32_t right_most);
+};
+
 // enum class Tag {
 //     INTEGER_LITERAL,
 //     REAL_LITERAL,
@@ -331,26 +686,80 @@ struct Parser {
 
 
 
-DB::DB(std::string& fn) {
+DB::DB(std::string& fn): DB(fn, nullptr) { }
+
+// vfs == nullptr picks the file system, or a private memory VFS for ":memory:" which starts as an empty database
+DB::DB(std::string& fn, Vfs* vfs): fn(fn), vfs(vfs), cache(&pool, 0, 0) {
+    if (this->vfs == nullptr && fn == ":memory:") {
+        own_vfs = std::make_unique<MemoryVfs>();
+        this->vfs = own_vfs.get();
+    } else if (this->vfs == nullptr) {
+        this->vfs = &DEFAULT_VFS;
+    }
 
-    if (!std::filesystem::exists(fn)) {
+    if (fn == ":memory:" && !this->vfs->exists(fn)) {
+        file = this->vfs->open(fn, true);
+        create_database(DEFAULT_PAGE_SIZE);
+    } else if (!this->vfs->exists(fn)) {
         std::cerr << "you would die\n";
-        file.open(fn, std::ios::binary | std::ios::in | std::ios::out);
         return;
+    } else {
+        file = this->vfs->open(fn);
     }
 
-    file.open(fn, std::ios::binary | std::ios::in | std::ios::out);
-
-    if (!file.is_open()) {
+    if (file == nullptr) {
         std::cerr << "everything is completely wrong\n";
         return;
     }
 
-    uint8_t* bytes = new uint8_t[100];
-    file.read(reinterpret_cast<char*>(bytes), 100);
+    // a VACUUM cut short while copying its image back
+    if (this->vfs->exists(fn + "-vacuum")) {
+        Vacuum(this).recover();
+    }
+
+    uint8_t bytes[100];
+    file->read(0, bytes, 100);
+    uint16_t page_size;
+    read_big_endian16(&page_size, bytes + 16);
+    header.page_size = page_size == 1 ? 65536 : page_size;
+    pool.page_size = get_page_size();
+    cache.page_size = get_page_size();
+
+    // a log left behind holds committed pages which never reached the database file
+    if (this->vfs->exists(fn + "-wal")) {
+        set_wal(true);
+    }
+
+    read_header();
+    if (wal.is_open() && wal.db_size != 0) {
+        header.database_size_in_pages = wal.db_size;
+    } else if (!check_inheader_dbsize()) {
+        header.database_size_in_pages = static_cast<uint32_t>(file->size() / get_page_size());
+    }
+    set_cache_size(static_cast<int32_t>(header.default_page_cache_size));
+    load_freelist();
+
+    parse_schema();
+}
+
+DB::~DB() {
+    if (in_transaction) {
+        rollback();
+    } else {
+        commit();
+    }
+    set_wal(false);
+    set_mmap(false);
+    set_io_uring(false);
+}
 
-    uint16_t offset = 16;
-    offset += read_big_endian16(&header.page_size, bytes + offset);
+void DB::read_header() {
+    uint8_t* bytes = pool.alloc();
+    read_page(1, bytes);
+
+    uint16_t offset = 16, page_size;
+    offset += read_big_endian16(&page_size, bytes + offset);
+    header.page_size = page_size == 1 ? 65536 : page_size;
     offset += read_big_endian8(&header.file_format_write_version, bytes + offset);
     offset += read_big_endian8(&header.file_format_read_version, bytes + offset);
     offset += read_big_endian8(&header.unused_reserved_space, bytes + offset);
@@ -372,606 +781,2959 @@ DB::DB(std::string& fn) {
     offset += 20;
     offset += read_big_endian32(&header.version_valid_for_number, bytes + offset);
     offset += read_big_endian32(&header.sqlite_version_number, bytes + offset);
-    delete[] bytes;
+    pool.free(bytes);
+}
 
-    parse_schema();
+// formats an empty file as a database with an empty sqlite_schema table on page 1
+bool DB::create_database(uint32_t page_size) {
+    std::vector<uint8_t> bytes(page_size, 0);
+    std::memcpy(bytes.data(), "SQLite format 3", 16);
+    write_big_endian16(page_size == 65536 ? 1 : page_size, bytes.data() + 16);
+    bytes[18] = 1; // file format write version: legacy
+    bytes[19] = 1; // file format read version: legacy
+    bytes[21] = 64; // max embedded payload fraction
+    bytes[22] = 32; // min embedded payload fraction
+    bytes[23] = 32; // leaf payload fraction
+    write_big_endian32(1, bytes.data() + 24); // file change counter
+    write_big_endian32(1, bytes.data() + 28); // database size in pages
+    write_big_endian32(4, bytes.data() + 44); // schema format number
+    write_big_endian32(1, bytes.data() + 56); // text encoding: UTF-8
+    write_big_endian32(1, bytes.data() + 92); // version valid for
+    write_big_endian32(3046000, bytes.data() + 96);
+    bytes[100] = static_cast<uint8_t>(BTreePageType::LeafTableBTreePage);
+    write_big_endian16(static_cast<uint16_t>(page_size), bytes.data() + 105); // start of cell content area, 65536 wraps to 0
+    return file->write(0, bytes.data(), page_size);
 }
 
+// pages stay dirty in the page cache until commit writes them back
 void DB::write(uint32_t pg_n, uint8_t* bytes) {
-    file.seekp((pg_n - 1) * get_page_size(), std::ios::beg);
-    file.write(reinterpret_cast<char*>(bytes), get_page_size());
-    
-    file.seekp(28, std::ios::beg);
-    uint8_t buffer[4];
-    write_big_endian32(header.database_size_in_pages, buffer);
-    file.write(reinterpret_cast<char*>(buffer), 4);
+    invalidate_resident(pg_n);
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    auto it = in_flight.find(pg_n);
+    if (it != in_flight.end()) {
+        it->second.stale = true;
+    }
+    cache.put_dirty(pg_n, bytes);
 }
 
-uint32_t DB::compute_database_size_in_pages() {
-    file.seekg(0, std::ios::end);
-    std::streampos file_size = file.tellg();
-
-    if (file_size == -1) {
-        std::cerr << "error determining file size.\n";
-        return 0;
+// in WAL mode commit appends frames to <db>-wal and the database file is only written by checkpoint
+bool DB::set_wal(bool enabled) {
+    if (!enabled) {
+        if (!wal.is_open()) {
+            return true;
+        }
+        commit();
+        if (!checkpoint()) {
+            return false;
+        }
+        wal.close();
+        vfs->remove(fn + "-wal");
+        return true;
+    }
+    if (wal.is_open()) {
+        return true;
     }
-    return static_cast<uint32_t>(file_size) / get_page_size();
+    commit();
+    return wal.open(vfs, fn + "-wal", get_page_size());
 }
 
-void DB::parse_create_table_sql(const std::string& sql) {
+void DB::execute(const std::string& sql) {
     Lexer lexer(sql);
     Token* token = lexer.scan();
-    std::string table_name;
-    uint16_t idx = 0;
 
-    while (token->tag != Tag::EOF_TOKEN && token->tag != Tag::ERROR) {
-        if (token->tag == Tag::CREATE) {
-            token = lexer.scan();
-            if (token->tag != Tag::TABLE) {
-                return;
-            }
-            token = lexer.scan();
-            if (token->tag != Tag::STRING_LITERAL) {
-                return;
+    switch (token->tag) {
+        case Tag::SELECT:
+            parse_select_sql(sql);
+            break;
+        case Tag::INSERT:
+            parse_insert_sql(sql);
+            break;
+        case Tag::DELETE:
+            parse_delete_sql(sql);
+            break;
+        case Tag::BEGIN:
+            begin();
+            break;
+        case Tag::COMMIT:
+            if (!in_transaction) {
+                std::cout << "cannot commit - no transaction is active\n";
+                break;
             }
-            StringLiteral* s = static_cast<StringLiteral*>(token);
-            table_name = s->value;
-        } else if (token->tag == Tag::STRING_LITERAL) {
-            StringLiteral* s = static_cast<StringLiteral*>(token);
-            std::string column_name = s->value;
-            token = lexer.scan();
-            if (token->tag == Tag::TYPE_TEXT) {
-                tables[table_name].columns[column_name] = idx;
-                tables[table_name].columns_affinity.push_back(ColumnAffinity::TEXT);
-            } else if (token->tag == Tag::TYPE_INTEGER) {
-                tables[table_name].columns[column_name] = idx;
-                tables[table_name].columns_affinity.push_back(ColumnAffinity::INTEGER);
+            commit();
+            break;
+        case Tag::ROLLBACK:
+            if (!in_transaction) {
+                std::cout << "cannot rollback - no transaction is active\n";
+                break;
             }
-        }
-        if (token->tag == Tag::COMMA) {
-            ++idx;
-        }
-        token = lexer.scan();
+            rollback();
+            break;
+        case Tag::VACUUM:
+            vacuum();
+            break;
+        default:
+            std::cout << "unsupported statement\n";
     }
 }
 
-void DB::parse_select_sql(const std::string& sql) {
-    Lexer lexer(sql);
-    Token* token = lexer.scan();
-    std::vector<std::string> columns;
-    std::string table_name, column_name;
-    bool select_all = false;
-    bool condition = false;
-    uint16_t idx = 0;
+bool DB::begin() {
+    if (file == nullptr) { // the database never opened
+        return false;
+    }
+    if (in_transaction) {
+        std::cout << "cannot start a transaction within a transaction\n";
+        return false;
+    }
+    // held until commit or rollback, other processes can't write meanwhile
+    if (!file->lock(LockType::Exclusive)) {
+        std::cout << "database is locked\n";
+        return false;
+    }
+    in_transaction = true;
+    transaction_size_in_pages = header.database_size_in_pages;
+    return true;
+}
 
-    if (token->tag != Tag::SELECT) {
-        std::cout << "need SELECT\n";
-        return;
+// writes every dirty page back at once: data pages in page order, then page 1 with the new page count,
+// pages overwritten in place are not journaled, so only a commit to the log is atomic
+bool DB::commit() {
+    if (file == nullptr) {
+        return false;
+    }
+    in_transaction = false;
+    if (cache.dirty.empty() && !freelist.dirty) {
+        file->unlock();
+        return true;
+    }
+    if (freelist.dirty) {
+        write_freelist();
     }
 
-    while (token->tag != Tag::FROM) {
-        token = lexer.scan();
-        if (token->tag == Tag::STRING_LITERAL) {
-            column_name = static_cast<StringLiteral*>(token)->value;
-            columns.push_back(column_name);
-        } else if (token->tag == Tag::ALL) {
-            select_all = true;
-        } else if (token->tag == Tag::EOF_TOKEN || token->tag == Tag::ERROR) {
-            return;
-        } else if (token->tag == Tag::COMMA) {
-            ++idx;
+    uint8_t* first_page = pool.alloc();
+    read_page(1, first_page);
+    // the page count at 28 is valid while the change counter matches version-valid-for
+    ++header.file_change_counter;
+    header.version_valid_for_number = header.file_change_counter;
+    write_big_endian32(header.file_change_counter, first_page + 24);
+    write_big_endian32(header.database_size_in_pages, first_page + 28);
+    write_big_endian32(header.version_valid_for_number, first_page + 92);
+    write_big_endian32(header.first_freelist_trunk_page, first_page + 32);
+    write_big_endian32(header.total_freelist_pages, first_page + 36);
+    write(1, first_page);
+    pool.free(first_page);
+
+    std::unique_lock<std::mutex> lock(cache_mutex);
+    bool ok = true;
+    for (uint32_t pg_n : cache.dirty) {
+        if (pg_n == 1) {
+            continue;
+        }
+        if (wal.is_open()) {
+            ok = ok && wal.append(pg_n, cache.get_dirty(pg_n), 0);
+        } else {
+            ok = ok && file->write(static_cast<uint64_t>(pg_n - 1) * get_page_size(), cache.get_dirty(pg_n), get_page_size());
         }
     }
 
-    token = lexer.scan();
-
-    if (token->tag != Tag::STRING_LITERAL) {
-        std::cout << "need table name\n";
-        return;
+    if (wal.is_open()) {
+        ok = ok && wal.append(1, cache.get_dirty(1), header.database_size_in_pages);
+        if (synchronous == Synchronous::Full) {
+            ok = ok && wal.file->sync();
+        }
+    } else {
+        if (synchronous == Synchronous::Full) {
+            ok = ok && file->sync();
+        }
+        ok = ok && file->write(0, cache.get_dirty(1), get_page_size());
+        if (synchronous != Synchronous::Off) {
+            ok = ok && file->sync();
+        }
     }
-    table_name = static_cast<StringLiteral*>(token)->value;
 
-    if (tables.count(table_name) == 0) {
-        std::cout << "no table name " << table_name << " in schema\n";
-        return;
+    if (!ok) {
+        std::cerr << "commit failed\n";
     }
-
-    token = lexer.scan();
-
-    if (token->tag == Tag::WHERE) {
-        condition = true;
+    if (backup_tracking) {
+        backup_changed.insert(cache.dirty.begin(), cache.dirty.end());
+    }
+    while (!cache.dirty.empty()) {
+        cache.mark_clean(*cache.dirty.begin());
     }
 
-    BTreePage root(this);
-    Payload p;
-    std::stack<uint32_t> stack;
-    stack.push(tables[table_name].root_pg_n);
-    uint16_t cell_content_offset;
-
-    size_t condition_i = lexer.i;
-    Parser parser(lexer, this, table_name);
-    
-    while (!stack.empty()) {
-        root.recreate(stack.top());
-        stack.pop();
-        
-        if (root.header.page_type == BTreePageType::LeafTableBTreePage) {
-            for (uint16_t idx = 0; idx < root.header.num_of_cells; ++idx) {
-                cell_content_offset = root.get_cell_content_offset(idx);
-                root.read_cell(cell_content_offset, &p);
+    if (map != nullptr && !wal.is_open() && static_cast<size_t>(header.database_size_in_pages) * get_page_size() > map_size && map_pins == 0) {
+        remap();
+    }
+    lock.unlock();
+    file->unlock();
 
-                if (condition) {
-                    parser.restart(condition_i);
-                    bool res = parser.parse_where(&p);
-                    if (!res) {
-                        continue;
-                    }
-                }
-                
-                if (select_all) {
-                    std::cout << "select all\n";
-                    p.print();
-                } else {
-                    for (std::string column : columns) {
-                        if (tables[table_name].columns.count(column) == 0) {
-                            std::cout << "no column: " << column << "in table " << table_name << "\n";
-                        } else {
-                            if (tables[table_name].columns_affinity[tables[table_name].columns[column]] == ColumnAffinity::TEXT) {
-                                std::string ans = p.get_text_column(tables[table_name].columns[column] + 1);
-                                std::cout << "text column: ";
-                                std::cout << ans << "\n";
-                            } else if (tables[table_name].columns_affinity[tables[table_name].columns[column]] == ColumnAffinity::INTEGER) {
-                                int64_t ans = p.get_integer_column(tables[table_name].columns[column] + 1);
-                                std::cout << "integer column: ";
-                                std::cout << ans << "\n";
-                            }
-                        }
-                    }
-                }
-            }
-        } else if (root.header.page_type == BTreePageType::InteriorTableBTreePage) {
-            for (uint16_t idx = 0; idx < root.header.num_of_cells; ++idx) {
-                cell_content_offset = root.get_cell_content_offset(idx);
-                stack.push(root.get_cell_left_child_pointer(cell_content_offset));
-            }
-            stack.push(root.get_right_most_pointer());
-        }
+    if (wal.is_open() && wal.n_frames >= WAL_AUTOCHECKPOINT) {
+        checkpoint();
     }
+    return ok;
 }
 
-void DB::parse_insert_sql(const std::string& sql) {
-    Lexer lexer(sql);
-    Token* token = lexer.scan();
-    std::string table_name;
-
-    if (token->tag != Tag::INSERT) {
-        std::cout << "need INSERT\n";
+void DB::rollback() {
+    if (file == nullptr) {
         return;
     }
+    in_transaction = false;
+    {
+        std::lock_guard<std::mutex> lock(cache_mutex);
+        cache.discard_dirty();
+        header.database_size_in_pages = transaction_size_in_pages;
+    }
+    {
+        std::lock_guard<std::shared_mutex> lock(resident_mutex);
+        for (auto& pair : resident) {
+            pair.second.stale = true;
+        }
+    }
+    rightmost_leaves.clear();
+    if (freelist.dirty) {
+        load_freelist();
+    }
+    file->unlock();
+}
 
-    lexer.scan();
+// copies the newest committed version of every logged page back into the database file
+bool DB::checkpoint() {
+    if (!wal.is_open()) {
+        return true;
+    }
+    if (!wal.pending.empty()) {
+        std::cerr << "cannot checkpoint in the middle of a write\n";
+        return false;
+    }
+    if (wal.index.empty()) {
+        return true;
+    }
+    // a transaction already holds the lock
+    if (!in_transaction && !file->lock(LockType::Exclusive)) {
+        std::cerr << "database is locked, checkpoint skipped\n";
+        return false;
+    }
+    bool ok = checkpoint_frames();
+    if (!in_transaction) {
+        file->unlock();
+    }
+    return ok;
+}
 
-    if (token->tag != Tag::INTO) {
-        std::cout << "need INTO\n";
-        return;
+bool DB::checkpoint_frames() {
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    if (synchronous != Synchronous::Off && !wal.file->sync()) {
+        return false;
     }
 
-    token = lexer.scan();
+    std::vector<std::pair<uint32_t, uint32_t>> frames(wal.index.begin(), wal.index.end());
+    std::sort(frames.begin(), frames.end());
 
-    if (token->tag != Tag::STRING_LITERAL) {
-        std::cout << "need table name\n";
-        return;
+    uint8_t* bytes = pool.alloc();
+    bool ok = true;
+    for (auto& pair : frames) {
+        ok = ok && wal.read_frame(pair.second, bytes);
+        ok = ok && file->write(static_cast<uint64_t>(pair.first - 1) * get_page_size(), bytes, get_page_size());
     }
-    table_name = static_cast<StringLiteral*>(token)->value;
+    pool.free(bytes);
 
-    if (tables.count(table_name) == 0) {
-        std::cout << "no table name " << table_name << " in schema\n";
-        return;
+    if (!ok || (synchronous != Synchronous::Off && !file->sync())) {
+        std::cerr << "checkpoint failed\n";
+        return false;
     }
-
+    // reads from the log must finish before its frames get reused
+    if (ring.is_open()) {
+        reap_reads(UINT32_MAX);
+    }
+    wal.reset();
+    if (map != nullptr && map_pins == 0) {
+        remap();
+    }
+    return true;
+}
+
+// in mmap mode pages are read straight from the mapping, the page cache only holds pages
+// which are past the end of the mapping (file grew while pages were pinned)
+bool DB::set_mmap(bool enabled) {
+    if (!enabled) {
+        if (map != nullptr) {
+            munmap(map, map_size);
+            map = nullptr;
+            map_size = 0;
+        }
+        return true;
+    }
+    if (map != nullptr) {
+        return true;
+    }
+    if (!remap()) {
+        return false;
+    }
+    cache.clear();
+    return true;
+}
+
+bool DB::remap() {
+    size_t size = file->size();
+    if (size == 0 || file->get_fd() == -1) {
+        return false;
+    }
+    if (map != nullptr) {
+        munmap(map, map_size);
+        map = nullptr;
+        map_size = 0;
+    }
+    void* addr = mmap(nullptr, size, PROT_READ, MAP_SHARED, file->get_fd(), 0);
+    if (addr == MAP_FAILED) {
+        std::cerr << "mmap failed\n";
+        return false;
+    }
+    map = static_cast<uint8_t*>(addr);
+    map_size = size;
+    return true;
+}
+
+// with io_uring on, prefetch queues real reads instead of fadvise hints and many pages are read at once,
+// pin_page collects finished reads and waits only for the page it needs
+bool DB::set_io_uring(bool enabled) {
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    if (!enabled) {
+        if (ring.is_open()) {
+            reap_reads(UINT32_MAX);
+            ring.close();
+        }
+        return true;
+    }
+    if (ring.is_open()) {
+        return true;
+    }
+    if (file->get_fd() == -1 || !ring.init(IO_URING_DEPTH)) {
+        std::cerr << "io_uring is not available\n";
+        return false;
+    }
+    return true;
+}
+
+// caller holds cache_mutex, false when the page needs no read or the ring is full
+bool DB::queue_read(uint32_t pg_n) {
+    if (in_flight.size() >= IO_URING_DEPTH) {
+        return false;
+    }
+    // dirty pages are always cached, so uncommitted log frames are never read here
+    if (pg_n == 0 || pg_n > header.database_size_in_pages || in_flight.count(pg_n) != 0 ||
+        cache.frames.count(pg_n) != 0 || cache.compressed.count(pg_n) != 0) {
+        return false;
+    }
+    uint32_t frame = wal.is_open() ? wal.find(pg_n) : 0;
+    int fd = frame != 0 ? wal.file->get_fd() : file->get_fd();
+    uint64_t offset = frame != 0 ? wal.frame_offset(frame) + WAL_FRAME_HEADER_SIZE : static_cast<uint64_t>(pg_n - 1) * get_page_size();
+    uint8_t* bytes = pool.alloc();
+    if (!ring.push_read(fd, offset, bytes, get_page_size(), pg_n)) {
+        pool.free(bytes);
+        return false;
+    }
+    in_flight[pg_n] = {bytes, false};
+    return true;
+}
+
+// caller holds cache_mutex, moves completed reads into the cache
+// never blocks unless wait_pg_n is in flight, UINT32_MAX waits for everything
+void DB::reap_reads(uint32_t wait_pg_n) {
+    uint64_t pg_n;
+    int32_t res;
+    if (!ring.submit()) {
+        // waiting on reads the kernel never took would hang, pin_page reads those itself
+        std::vector<uint64_t> dropped;
+        ring.drop_unsubmitted(&dropped);
+        for (uint64_t dropped_pg_n : dropped) {
+            auto it = in_flight.find(dropped_pg_n);
+            if (it != in_flight.end()) {
+                pool.free(it->second.bytes);
+                in_flight.erase(it);
+            }
+        }
+    }
+    while (!in_flight.empty()) {
+        bool wait = wait_pg_n == UINT32_MAX || in_flight.count(wait_pg_n) != 0;
+        if (!ring.pop(&pg_n, &res, wait)) {
+            break;
+        }
+        auto it = in_flight.find(pg_n);
+        if (it == in_flight.end()) {
+            continue;
+        }
+        // short reads (past the end of file) and failed ones are dropped, pin_page reads those itself
+        if (res == static_cast<int32_t>(get_page_size()) && !it->second.stale) {
+            cache.pin_new(pg_n, it->second.bytes);
+            cache.unpin(pg_n);
+        } else {
+            pool.free(it->second.bytes);
+        }
+        in_flight.erase(it);
+    }
+}
+
+void DB::set_cache_size(int32_t cache_size) {
+    if (cache_size == 0) {
+        cache_size = DEFAULT_CACHE_SIZE;
+    }
+    if (cache_size > 0) {
+        cache.resize(cache_size);
+    } else {
+        cache.resize(std::max<int64_t>(1, -1024 * static_cast<int64_t>(cache_size) / get_page_size()));
+    }
+}
+
+// budget of the second tier, same units as set_cache_size, 0 turns it off
+// it holds pages evicted from the page cache compressed, so a miss there can still skip the file
+void DB::set_compressed_cache_size(int32_t cache_size) {
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    if (cache_size > 0) {
+        cache.resize_compressed(static_cast<size_t>(cache_size) * get_page_size());
+    } else {
+        cache.resize_compressed(-1024 * static_cast<int64_t>(cache_size));
+    }
+}
+
+// returned bytes stay valid until unpin_page, which gets mapped back to release the same kind of pin:
+// the cache may hold a frame for the page by then, a writer dirtied it, say
+const uint8_t* DB::pin_page(uint32_t pg_n, bool* mapped) {
+    std::unique_lock<std::mutex> lock(cache_mutex);
+    uint32_t frame = wal.is_open() ? wal.find(pg_n) : 0;
+    *mapped = map != nullptr && frame == 0 && cache.dirty.count(pg_n) == 0 && static_cast<size_t>(pg_n) * get_page_size() <= map_size;
+    if (*mapped) {
+        ++map_pins;
+        return map + static_cast<size_t>(pg_n - 1) * get_page_size();
+    }
+    if (!in_flight.empty()) {
+        reap_reads(pg_n);
+    }
+    uint8_t* bytes = cache.pin(pg_n);
+    if (bytes != nullptr) {
+        return bytes;
+    }
+    lock.unlock();
+
+    // miss: read without holding the lock so other threads can fetch their pages meanwhile
+    bytes = pool.alloc();
+    if (frame != 0) {
+        wal.read_frame(frame, bytes);
+    } else {
+        file->read(static_cast<uint64_t>(pg_n - 1) * get_page_size(), bytes, get_page_size());
+    }
+
+    lock.lock();
+    return cache.pin_new(pg_n, bytes);
+}
+
+void DB::unpin_page(uint32_t pg_n, bool mapped) {
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    if (mapped) {
+        --map_pins;
+    } else {
+        cache.unpin(pg_n);
+    }
+}
+
+void DB::read_page(uint32_t pg_n, uint8_t* bytes) {
+    bool mapped;
+    std::memcpy(bytes, pin_page(pg_n, &mapped), get_page_size());
+    unpin_page(pg_n, mapped);
+}
+
+// reads the overflow chain starting at pg_n as if it were the contiguous run pg_n, pg_n + 1, ...
+// with one vectored read, page contents go straight to payload and the next pointers are checked afterwards
+// returns how many pages of the chain were read, 0 when the run can't be read from the file directly
+// (first page cached, dirty, in the log or in flight) and the caller has to go page by page
+uint32_t DB::read_overflow_run(uint32_t pg_n, uint64_t n_bytes, uint8_t* payload, uint32_t* next_pg_n) {
+    uint32_t content_size = get_U() - 4;
+    uint32_t n_pages = (n_bytes + content_size - 1) / content_size;
+    if (map != nullptr || n_pages < 2) {
+        return 0;
+    }
+    {
+        std::lock_guard<std::mutex> lock(cache_mutex);
+        for (uint32_t i = 0; i < n_pages; ++i) {
+            uint32_t run_pg_n = pg_n + i;
+            if (run_pg_n > header.database_size_in_pages || cache.frames.count(run_pg_n) != 0 ||
+                in_flight.count(run_pg_n) != 0 || (wal.is_open() && wal.find(run_pg_n) != 0)) {
+                n_pages = i;
+                break;
+            }
+        }
+    }
+    if (n_pages < 2) {
+        return 0;
+    }
+
+    std::vector<uint32_t> next(n_pages);
+    std::vector<uint8_t> reserved(get_page_size() - get_U());
+    std::vector<iovec> iov;
+    iov.reserve(3 * n_pages);
+    for (uint32_t i = 0; i < n_pages; ++i) {
+        uint64_t n = std::min<uint64_t>(content_size, n_bytes - static_cast<uint64_t>(i) * content_size);
+        iov.push_back({&next[i], 4});
+        iov.push_back({payload + static_cast<uint64_t>(i) * content_size, n});
+        if (!reserved.empty() && i + 1 < n_pages) {
+            iov.push_back({reserved.data(), reserved.size()});
+        }
+    }
+    if (!file->read(static_cast<uint64_t>(pg_n - 1) * get_page_size(), iov.data(), static_cast<int>(iov.size()))) {
+        return 0;
+    }
+
+    // the chain leaves the run at the first page whose next pointer is not the following page,
+    // everything read after it belongs to other chains and gets overwritten by the caller
+    for (uint32_t i = 0; i < n_pages; ++i) {
+        read_big_endian32(next_pg_n, reinterpret_cast<uint8_t*>(&next[i]));
+        if (*next_pg_n != pg_n + i + 1) {
+            return i + 1;
+        }
+    }
+    return n_pages;
+}
+
+// read-ahead hint, returns at once, the pages arrive in the OS page cache in the background
+void DB::prefetch(uint32_t pg_n, uint32_t n_pages) {
+    if (ring.is_open() && map == nullptr) {
+        std::lock_guard<std::mutex> lock(cache_mutex);
+        for (uint32_t i = 0; i < n_pages; ++i) {
+            if (in_flight.size() >= IO_URING_DEPTH) {
+                reap_reads(0);
+            }
+            queue_read(pg_n + i);
+        }
+        reap_reads(0);
+        return;
+    }
+    uint64_t offset = static_cast<uint64_t>(pg_n - 1) * get_page_size();
+    uint64_t length = static_cast<uint64_t>(n_pages) * get_page_size();
+    if (map == nullptr) {
+        file->prefetch(offset, length);
+        return;
+    }
+    if (offset >= map_size) {
+        return;
+    }
+    length = std::min<uint64_t>(length, map_size - offset);
+    uint64_t os_page_size = sysconf(_SC_PAGESIZE);
+    uint64_t start = offset / os_page_size * os_page_size;
+    madvise(map + start, offset + length - start, MADV_WILLNEED);
+}
+
+// skips pages which are already in memory and merges the rest into contiguous runs
+void DB::prefetch_pages(std::vector<uint32_t>& pages) {
+    std::sort(pages.begin(), pages.end());
+    {
+        std::lock_guard<std::mutex> lock(cache_mutex);
+        if (ring.is_open() && map == nullptr) {
+            for (uint32_t pg_n : pages) {
+                if (in_flight.size() >= IO_URING_DEPTH) {
+                    reap_reads(0);
+                }
+                queue_read(pg_n);
+            }
+            reap_reads(0);
+            return;
+        }
+        pages.erase(std::remove_if(pages.begin(), pages.end(), [this](uint32_t pg_n) {
+            return cache.frames.count(pg_n) != 0 || cache.compressed.count(pg_n) != 0 || (wal.is_open() && wal.find(pg_n) != 0);
+        }), pages.end());
+    }
+
+    size_t i = 0;
+    while (i < pages.size()) {
+        size_t j = i + 1;
+        while (j < pages.size() && pages[j] == pages[j - 1] + 1) {
+            ++j;
+        }
+        prefetch(pages[i], j - i);
+        i = j;
+    }
+}
+
+// new pages live in the page cache until commit and in the log until checkpoint,
+// so the file size lags behind, the in-header size was validated on open
+uint32_t DB::compute_database_size_in_pages() {
+    return header.database_size_in_pages;
+}
+
+uint32_t DB::allocate_page() {
+    return allocate_pages(1);
+}
+
+// n_pages consecutive pages, from the freelist when it has a long enough run, otherwise the file grows
+// the file size is only known through header.database_size_in_pages, nothing here touches the file
+uint32_t DB::allocate_pages(uint32_t n_pages) {
+    uint32_t pg_n;
+    if (freelist.take(n_pages, &pg_n)) {
+        return pg_n;
+    }
+    pg_n = header.database_size_in_pages + 1;
+    uint32_t lock_byte_pg_n = get_lock_byte_pg_n();
+    if (pg_n > lock_byte_pg_n || lock_byte_pg_n >= pg_n + n_pages) {
+        header.database_size_in_pages += n_pages;
+        return pg_n;
+    }
+    // the run starts past the lock byte page, the pages before it go to the freelist
+    header.database_size_in_pages = lock_byte_pg_n + n_pages;
+    for (; pg_n < lock_byte_pg_n; ++pg_n) {
+        free_page(pg_n);
+    }
+    return lock_byte_pg_n + 1;
+}
+
+// the page content is left as is, free pages are never read
+void DB::free_page(uint32_t pg_n) {
+    if (pg_n > 1 && pg_n <= header.database_size_in_pages) {
+        freelist.add(pg_n);
+    }
+}
+
+// reads the committed trunk chain, called on open and when a rollback undoes allocations
+void DB::load_freelist() {
+    freelist.clear();
+    uint8_t* bytes = pool.alloc();
+    read_page(1, bytes);
+    read_big_endian32(&header.first_freelist_trunk_page, bytes + 32);
+    read_big_endian32(&header.total_freelist_pages, bytes + 36);
+
+    uint32_t trunk = header.first_freelist_trunk_page;
+    uint32_t n_leaves;
+    for (uint32_t n_trunks = 0; trunk != 0 && trunk <= header.database_size_in_pages && n_trunks < header.total_freelist_pages; ++n_trunks) {
+        read_page(trunk, bytes);
+        freelist.add(trunk);
+        FreeTrunk& free_trunk = freelist.trunks.emplace_back();
+        free_trunk.pg_n = trunk;
+        read_big_endian32(&trunk, bytes);
+        read_big_endian32(&n_leaves, bytes + 4);
+        // whatever is dropped here gets fixed on the next commit
+        free_trunk.changed = n_leaves > get_U() / 4 - 2;
+        n_leaves = std::min<uint32_t>(n_leaves, get_U() / 4 - 2);
+        for (uint32_t i = 0; i < n_leaves; ++i) {
+            uint32_t leaf;
+            read_big_endian32(&leaf, bytes + 8 + 4 * i);
+            if (leaf > 1 && leaf <= header.database_size_in_pages) {
+                freelist.add(leaf);
+                free_trunk.leaves.push_back(leaf);
+            } else {
+                free_trunk.changed = true;
+            }
+        }
+    }
+    if (trunk != 0 && !freelist.trunks.empty()) {
+        freelist.trunks.back().changed = true;
+    }
+    pool.free(bytes);
+    freelist.dirty = false;
+}
+
+// patches the trunk chain read from disk instead of rebuilding it: pages no longer free leave it,
+// new free pages fill the trunks with room and what is left starts new trunks at the head of the chain,
+// the highest of those pages become the trunks so the low runs stay whole for overflow chains
+// only trunks that changed are written, a big freelist costs as many page writes as pages freed or taken
+void DB::write_freelist() {
+    uint32_t leaves_per_trunk = get_U() / 4 - 8; // SQLite never fills trunks further, older readers rely on it
+    std::vector<bool> in_chain(header.database_size_in_pages + 1);
+    std::vector<FreeTrunk> kept;
+    for (FreeTrunk& trunk : freelist.trunks) {
+        if (!freelist.contains(trunk.pg_n) || in_chain[trunk.pg_n]) {
+            if (!kept.empty()) {
+                kept.back().changed = true; // points past the dropped trunk now
+            }
+            continue;
+        }
+        in_chain[trunk.pg_n] = true;
+        // reused in this transaction and freed again, its page holds something else by now
+        trunk.changed = trunk.changed || cache.dirty.count(trunk.pg_n) != 0;
+        auto end = std::remove_if(trunk.leaves.begin(), trunk.leaves.end(), [&](uint32_t leaf) {
+            if (!freelist.contains(leaf) || in_chain[leaf]) {
+                return true;
+            }
+            in_chain[leaf] = true;
+            return false;
+        });
+        if (end != trunk.leaves.end()) {
+            trunk.leaves.erase(end, trunk.leaves.end());
+            trunk.changed = true;
+        }
+        kept.push_back(std::move(trunk));
+    }
+
+    std::vector<uint32_t> pages;
+    for (uint32_t pg_n : freelist.pages()) {
+        if (!in_chain[pg_n]) {
+            pages.push_back(pg_n);
+        }
+    }
+    size_t next = 0;
+    for (FreeTrunk& trunk : kept) {
+        if (next == pages.size()) {
+            break;
+        }
+        if (trunk.leaves.size() < leaves_per_trunk) {
+            size_t count = std::min<size_t>(leaves_per_trunk - trunk.leaves.size(), pages.size() - next);
+            trunk.leaves.insert(trunk.leaves.end(), pages.begin() + next, pages.begin() + next + count);
+            next += count;
+            trunk.changed = true;
+        }
+    }
+    size_t n_rest = pages.size() - next;
+    size_t n_trunks = (n_rest + leaves_per_trunk) / (leaves_per_trunk + 1);
+    size_t n_leaves = n_rest - n_trunks;
+    std::vector<FreeTrunk> chain(n_trunks);
+    for (size_t t = 0; t < n_trunks; ++t) {
+        size_t first_leaf = next + t * leaves_per_trunk;
+        size_t count = std::min<size_t>(leaves_per_trunk, n_leaves - t * leaves_per_trunk);
+        chain[t].pg_n = pages[next + n_leaves + t];
+        chain[t].leaves.assign(pages.begin() + first_leaf, pages.begin() + first_leaf + count);
+        chain[t].changed = true;
+    }
+    chain.insert(chain.end(), std::make_move_iterator(kept.begin()), std::make_move_iterator(kept.end()));
+
+    uint8_t* bytes = pool.alloc();
+    for (size_t t = 0; t < chain.size(); ++t) {
+        if (!chain[t].changed) {
+            continue;
+        }
+        std::memset(bytes, 0, get_page_size());
+        write_big_endian32(t + 1 < chain.size() ? chain[t + 1].pg_n : 0, bytes);
+        write_big_endian32(chain[t].leaves.size(), bytes + 4);
+        for (size_t i = 0; i < chain[t].leaves.size(); ++i) {
+            write_big_endian32(chain[t].leaves[i], bytes + 8 + 4 * i);
+        }
+        write(chain[t].pg_n, bytes);
+        chain[t].changed = false;
+    }
+    pool.free(bytes);
+
+    header.first_freelist_trunk_page = chain.empty() ? 0 : chain[0].pg_n;
+    header.total_freelist_pages = freelist.n_pages;
+    freelist.trunks = std::move(chain);
+    freelist.dirty = false;
+}
+
+void DB::parse_create_table_sql(const std::string& sql) {
+    Lexer lexer(sql);
+    Token* token = lexer.scan();
+    std::string table_name;
+    uint16_t idx = 0;
+
+    while (token->tag != Tag::EOF_TOKEN && token->tag != Tag::ERROR) {
+        if (token->tag == Tag::CREATE) {
+            token = lexer.scan();
+            if (token->tag != Tag::TABLE) {
+                return;
+            }
+            token = lexer.scan();
+            if (token->tag != Tag::STRING_LITERAL) {
+                return;
+            }
+            StringLiteral* s = static_cast<StringLiteral*>(token);
+            table_name = s->value;
+        } else if (token->tag == Tag::STRING_LITERAL) {
+            StringLiteral* s = static_cast<StringLiteral*>(token);
+            std::string column_name = s->value;
+            token = lexer.scan();
+            if (token->tag == Tag::TYPE_TEXT) {
+                tables[table_name].columns[column_name] = idx;
+                tables[table_name].columns_affinity.push_back(ColumnAffinity::TEXT);
+            } else if (token->tag == Tag::TYPE_INTEGER) {
+                tables[table_name].columns[column_name] = idx;
+                tables[table_name].columns_affinity.push_back(ColumnAffinity::INTEGER);
+            }
+        }
+        if (token->tag == Tag::COMMA) {
+            ++idx;
+        }
+        token = lexer.scan();
+    }
+}
+
+void DB::parse_select_sql(const std::string& sql) {
+    Lexer lexer(sql);
+    Token* token = lexer.scan();
+    std::vector<std::string> columns;
+    std::string table_name, column_name;
+    bool select_all = false;
+    bool condition = false;
+    uint16_t idx = 0;
+
+    if (token->tag != Tag::SELECT) {
+        std::cout << "need SELECT\n";
+        return;
+    }
+
+    while (token->tag != Tag::FROM) {
+        token = lexer.scan();
+        if (token->tag == Tag::STRING_LITERAL) {
+            column_name = static_cast<StringLiteral*>(token)->value;
+            columns.push_back(column_name);
+        } else if (token->tag == Tag::ALL) {
+            select_all = true;
+        } else if (token->tag == Tag::EOF_TOKEN || token->tag == Tag::ERROR) {
+            return;
+        } else if (token->tag == Tag::COMMA) {
+            ++idx;
+        }
+    }
+
+    token = lexer.scan();
+
+    if (token->tag != Tag::STRING_LITERAL) {
+        std::cout << "need table name\n";
+        return;
+    }
+    table_name = static_cast<StringLiteral*>(token)->value;
+
+    if (tables.count(table_name) == 0) {
+        std::cout << "no table name " << table_name << " in schema\n";
+        return;
+    }
+
     token = lexer.scan();
 
-    if (token->tag != Tag::VALUES) {
-        std::cout << "need VALUES\n";
+    if (token->tag == Tag::WHERE) {
+        condition = true;
+    }
+
+    BTreePage root(this);
+    PayloadView p;
+    std::stack<uint32_t> stack;
+    stack.push(tables[table_name].root_pg_n);
+    uint16_t cell_content_offset;
+
+    size_t condition_i = lexer.i;
+    Parser parser(lexer, this, table_name);
+    
+    while (!stack.empty()) {
+        root.recreate(stack.top());
+        stack.pop();
+        
+        if (root.header.page_type == BTreePageType::LeafTableBTreePage) {
+            root.prefetch_overflow();
+            for (uint16_t idx = 0; idx < root.header.num_of_cells; ++idx) {
+                cell_content_offset = root.get_cell_content_offset(idx);
+                root.read_cell(cell_content_offset, &p);
+
+                if (condition) {
+                    parser.restart(condition_i);
+                    bool res = parser.parse_where(&p);
+                    if (!res) {
+                        continue;
+                    }
+                }
+                
+                if (select_all) {
+                    std::cout << "select all\n";
+                    p.print();
+                } else {
+                    for (const std::string& column : columns) {
+                        if (tables[table_name].columns.count(column) == 0) {
+                            std::cout << "no column: " << column << "in table " << table_name << "\n";
+                        } else {
+                            if (tables[table_name].columns_affinity[tables[table_name].columns[column]] == ColumnAffinity::TEXT) {
+                                std::string_view ans = p.get_text_column(tables[table_name].columns[column] + 1);
+                                std::cout << "text column: ";
+                                std::cout << ans << "\n";
+                            } else if (tables[table_name].columns_affinity[tables[table_name].columns[column]] == ColumnAffinity::INTEGER) {
+                                int64_t ans = p.get_integer_column(tables[table_name].columns[column] + 1);
+                                std::cout << "integer column: ";
+                                std::cout << ans << "\n";
+                            }
+                        }
+                    }
+                }
+            }
+        } else if (root.header.page_type == BTreePageType::InteriorTableBTreePage) {
+            root.prefetch_children();
+            for (uint16_t idx = 0; idx < root.header.num_of_cells; ++idx) {
+                cell_content_offset = root.get_cell_content_offset(idx);
+                stack.push(root.get_cell_left_child_pointer(cell_content_offset));
+            }
+            stack.push(root.get_right_most_pointer());
+        }
+    }
+}
+
+void DB::parse_insert_sql(const std::string& sql) {
+    Lexer lexer(sql);
+    Token* token = lexer.scan();
+    std::string table_name;
+
+    if (token->tag != Tag::INSERT) {
+        std::cout << "need INSERT\n";
+        return;
+    }
+
+    lexer.scan();
+
+    if (token->tag != Tag::INTO) {
+        std::cout << "need INTO\n";
+        return;
+    }
+
+    token = lexer.scan();
+
+    if (token->tag != Tag::STRING_LITERAL) {
+        std::cout << "need table name\n";
+        return;
+    }
+    table_name = static_cast<StringLiteral*>(token)->value;
+
+    if (tables.count(table_name) == 0) {
+        std::cout << "no table name " << table_name << " in schema\n";
+        return;
+    }
+
+    token = lexer.scan();
+
+    if (token->tag != Tag::VALUES) {
+        std::cout << "need VALUES\n";
+    }
+
+    Parser parser(lexer, this, table_name);
+    Payload p;
+
+    bool res = parser.parse_values(&p);
+
+    if (!res) {
+        std::cout << "bad values\n";
+        return;
+    }
+
+    if (p.rowid == 0) {
+        std::cout << "everything wrong\n";
+        return;
+    }
+
+    bool autocommit = !in_transaction;
+    if (autocommit && !begin()) {
+        return;
+    }
+
+    ReturnCodes rc = insert(tables[table_name].root_pg_n, p.rowid, &p);
+
+    if (rc == ReturnCodes::RowidAlreadyInDatabase) {
+        std::cout << "cell with id already in database\n";
+    } else if (rc != ReturnCodes::CellInserted) {
+        std::cout << "everything wrong\n";
+    }
+
+    if (autocommit) {
+        if (rc == ReturnCodes::CellInserted) {
+            commit();
+        } else {
+            rollback();
+        }
+    }
+}
+
+// DELETE FROM table_name [WHERE expr], the matching rowids are collected first and removed afterwards,
+// so the scan never walks pages which removal is merging
+// no WHERE or one on nothing but id is a rowid range, remove_range takes it out a subtree at a time
+void DB::parse_delete_sql(const std::string& sql) {
+    Lexer lexer(sql);
+    Token* token = lexer.scan();
+    std::string table_name;
+
+    if (token->tag != Tag::DELETE) {
+        std::cout << "need DELETE\n";
+        return;
+    }
+
+    token = lexer.scan();
+
+    if (token->tag != Tag::FROM) {
+        std::cout << "need FROM\n";
+        return;
+    }
+
+    token = lexer.scan();
+
+    if (token->tag != Tag::STRING_LITERAL) {
+        std::cout << "need table name\n";
+        return;
+    }
+    table_name = static_cast<StringLiteral*>(token)->value;
+
+    if (tables.count(table_name) == 0) {
+        std::cout << "no table name " << table_name << " in schema\n";
+        return;
+    }
+
+    // the index b-trees would keep entries for the removed rows
+    for (auto& index : indexes) {
+        if (index.second.table_name == table_name) {
+            std::cout << "cannot DELETE from " << table_name << ", index " << index.first << " would not be updated\n";
+            return;
+        }
+    }
+
+    token = lexer.scan();
+
+    bool condition = token->tag == Tag::WHERE;
+    if (!condition && token->tag != Tag::EOF_TOKEN) {
+        std::cout << "need WHERE\n";
+        return;
+    }
+
+    uint32_t root_pg_n = tables[table_name].root_pg_n;
+    std::vector<uint64_t> rowids;
+    BTreePage page(this);
+    PayloadView p;
+    std::stack<uint32_t> stack;
+
+    size_t condition_i = lexer.i;
+    Parser parser(lexer, this, table_name);
+
+    uint64_t low = 0, high = UINT64_MAX;
+    bool range = !condition || parser.parse_rowid_range(&low, &high);
+    if (!range) {
+        stack.push(root_pg_n);
+    }
+
+    while (!stack.empty()) {
+        page.recreate(stack.top());
+        stack.pop();
+
+        if (page.header.page_type == BTreePageType::LeafTableBTreePage) {
+            if (condition) {
+                page.prefetch_overflow();
+            }
+            for (uint16_t idx = 0; idx < page.header.num_of_cells; ++idx) {
+                uint16_t cell_content_offset = page.get_cell_content_offset(idx);
+                if (!condition) {
+                    rowids.push_back(page.get_cell_rowid(cell_content_offset));
+                    continue;
+                }
+                page.read_cell(cell_content_offset, &p);
+                parser.restart(condition_i);
+                if (parser.parse_where(&p)) {
+                    rowids.push_back(p.rowid);
+                }
+            }
+        } else if (page.header.page_type == BTreePageType::InteriorTableBTreePage) {
+            page.prefetch_children();
+            // the left-most child on top, leaves come in rowid order
+            stack.push(page.get_right_most_pointer());
+            for (uint16_t idx = page.header.num_of_cells; idx > 0; --idx) {
+                stack.push(page.get_cell_left_child_pointer(page.get_cell_content_offset(idx - 1)));
+            }
+        }
+    }
+
+    bool autocommit = !in_transaction;
+    if (autocommit && !begin()) {
+        return;
+    }
+
+    bool ok = true;
+    if (range) {
+        remove_range(root_pg_n, low, high);
+    }
+    for (uint64_t rowid : rowids) {
+        if (remove(root_pg_n, rowid) != ReturnCodes::CellDeleted) {
+            std::cout << "everything wrong\n";
+            ok = false;
+            break;
+        }
+    }
+
+    if (autocommit) {
+        if (ok) {
+            commit();
+        } else {
+            rollback();
+        }
+    }
+}
+
+void DB::parse_schema() {
+    BTreePage schema(this);
+    Payload p;
+    std::stack<uint32_t> stack;
+    stack.push(1);
+    uint16_t cell_content_offset;
+    
+    while (!stack.empty()) {
+        schema.recreate(stack.top());
+        stack.pop();
+        
+        if (schema.header.page_type == BTreePageType::LeafTableBTreePage) {
+            for (uint16_t idx = 0; idx < schema.header.num_of_cells; ++idx) {
+                cell_content_offset = schema.get_cell_content_offset(idx);
+                schema.read_cell(cell_content_offset, &p);
+                std::string schema_type = p.get_text_column(1);
+                SchemaTypeColumn type = SCHEMA_TYPES[schema_type];
+                if (type == SchemaTypeColumn::Table) {
+                    std::string table_name = p.get_text_column(2);
+                    tables[table_name] = TableSchema();
+                    uint64_t root_pg_n = p.get_integer_column(4);
+                    tables[table_name].root_pg_n = root_pg_n;
+                    std::string sql = p.get_text_column(5);
+                    parse_create_table_sql(sql);
+                } else if (type == SchemaTypeColumn::Index) {
+                    indexes[p.get_text_column(2)] = {static_cast<uint32_t>(p.get_integer_column(4)), p.get_text_column(3)};
+                }
+            }
+        } else if (schema.header.page_type == BTreePageType::InteriorTableBTreePage) {
+            for (uint16_t idx = 0; idx < schema.header.num_of_cells; ++idx) {
+                cell_content_offset = schema.get_cell_content_offset(idx);
+                stack.push(schema.get_cell_left_child_pointer(cell_content_offset));
+            }
+            stack.push(schema.get_right_most_pointer());
+        }
+    }
+}
+
+uint32_t DB::get_root_page_number(std::string& table_name) {
+    return tables[table_name].root_pg_n;
+}
+
+bool DB::check_inheader_dbsize() {
+    return header.database_size_in_pages > 0 && header.file_change_counter == header.version_valid_for_number;
+}
+
+uint32_t DB::get_page_size() {
+    return header.page_size;
+}
+
+uint32_t DB::get_U() {
+    return get_page_size() - header.unused_reserved_space;
+}
+
+// the page holding the byte at 1 GiB which file locks are taken on, never used by SQLite
+uint32_t DB::get_lock_byte_pg_n() {
+    return 0x40000000 / get_page_size() + 1;
+}
+
+ReturnCodes DB::insert(uint32_t root_pg_n, uint64_t id, Payload* payload) {
+    auto hint = rightmost_leaves.find(root_pg_n);
+    if (hint != rightmost_leaves.end() && id > hint->second.max_rowid) {
+        BTreePage leaf(this, hint->second.pg_n);
+        uint16_t n_cells = leaf.header.num_of_cells;
+        // the leaf is checked to still end with the rowid it had, anything else takes the way from the root
+        if (leaf.header.page_type == BTreePageType::LeafTableBTreePage && n_cells != 0 &&
+            leaf.get_cell_rowid(leaf.get_cell_content_offset(n_cells - 1)) == hint->second.max_rowid &&
+            leaf.insert_leaf_cell(id, n_cells, payload) == ReturnCodes::CellInserted) {
+            write(hint->second.pg_n, leaf.bytes);
+            hint->second.max_rowid = id;
+            return ReturnCodes::CellInserted;
+        }
+    }
+
+    uint32_t current_pg_n = root_pg_n;
+    BTreePage current_page(this, current_pg_n);
+    std::vector<Balancer::Level> path;
+    bool rightmost = true;
+
+    while (current_page.header.page_type != BTreePageType::LeafTableBTreePage) {
+        uint16_t idx = current_page.lower_bound(id);
+        path.push_back({current_pg_n, idx});
+        rightmost = rightmost && idx == current_page.header.num_of_cells;
+
+        if (idx != current_page.header.num_of_cells) {
+            uint16_t cell_content_offset = current_page.get_cell_content_offset(idx);
+            current_pg_n = current_page.get_cell_left_child_pointer(cell_content_offset);
+        } else {
+            current_pg_n = current_page.get_right_most_pointer();
+        }
+        current_page.recreate(current_pg_n);
+    }
+
+    uint16_t idx = current_page.lower_bound(id);
+    if (idx != current_page.header.num_of_cells) {
+        uint16_t cell_content_offset = current_page.get_cell_content_offset(idx);
+        if (current_page.get_cell_rowid(cell_content_offset) == id) {
+            return ReturnCodes::RowidAlreadyInDatabase;
+        }
+    }
+
+    rightmost = rightmost && idx == current_page.header.num_of_cells;
+    ReturnCodes rc = current_page.insert_leaf_cell(id, idx, payload);
+    if (rc == ReturnCodes::CellInserted) {
+        write(current_pg_n, current_page.bytes);
+        if (rightmost) {
+            rightmost_leaves[root_pg_n] = {current_pg_n, id};
+        }
+        return rc;
+    }
+
+    // the new cell is built on an empty page of its own, overflow pages included, and joins the others from there
+    BTreePage cell_page(this, BTreePageType::LeafTableBTreePage);
+    rc = cell_page.insert_leaf_cell(id, 0, payload);
+    if (rc != ReturnCodes::CellInserted) {
+        return ReturnCodes::EverythingWrong;
+    }
+    uint16_t cell_content_offset = cell_page.get_cell_content_offset(0);
+
+    path.push_back({current_pg_n, idx});
+    Balancer balancer(this, path, BTreePageType::LeafTableBTreePage);
+    balancer.cells.add_page(current_page, 0, idx);
+    balancer.cells.add(cell_page.bytes + cell_content_offset, cell_page.get_cell_size(cell_content_offset));
+    balancer.cells.add_page(current_page, idx, current_page.header.num_of_cells);
+    balancer.append = rightmost;
+    balancer.run();
+    if (balancer.rightmost_leaf_pg_n != 0) {
+        rightmost_leaves[root_pg_n] = {balancer.rightmost_leaf_pg_n, id};
+    } else {
+        rightmost_leaves.erase(root_pg_n);
+    }
+    return ReturnCodes::CellInserted;
+}
+
+void Balancer::Cells::add(const uint8_t* cell, uint32_t n) {
+    bytes.insert(bytes.end(), cell, cell + n);
+    offsets.push_back(bytes.size());
+}
+
+void Balancer::Cells::add(uint32_t left_child_pointer, const uint8_t* cell, uint32_t n) {
+    uint8_t pointer[4];
+    write_big_endian32(left_child_pointer, pointer);
+    bytes.insert(bytes.end(), pointer, pointer + 4);
+    add(cell, n);
+}
+
+void Balancer::Cells::add_page(BTreePage& page, uint16_t from, uint16_t to) {
+    for (uint16_t i = from; i < to; ++i) {
+        uint16_t cell_content_offset = page.get_cell_content_offset(i);
+        add(page.bytes + cell_content_offset, page.get_cell_size(cell_content_offset));
+    }
+}
+
+uint64_t Balancer::Cells::get_leaf_rowid(size_t i) {
+    uint64_t num_payload_bytes, rowid;
+    uint8_t* cell = get(i);
+    read_varint(&rowid, cell + read_varint(&num_payload_bytes, cell));
+    return rowid;
+}
+
+void Balancer::run() {
+    bool settled = append ? balance_quick(path.size() - 1) : balance(path.size() - 1);
+    while (!settled) {
+        settled = balance(path.size() - 1);
+    }
+}
+
+// the root keeps its page number: its cells go to a new only child and it becomes an interior page above it
+void Balancer::deepen_root() {
+    uint32_t child_pg_n = db->allocate_page();
+    BTreePage root(db, path[0].pg_n);
+    bool is_index = page_type == BTreePageType::LeafIndexBTreePage || page_type == BTreePageType::InteriorIndexBTreePage;
+    root.header.page_type = is_index ? BTreePageType::InteriorIndexBTreePage : BTreePageType::InteriorTableBTreePage;
+    fill(root, cells, 0, 0, child_pg_n);
+    db->write(path[0].pg_n, root.bytes);
+
+    path.insert(path.begin() + 1, {child_pg_n, path[0].idx});
+    path[0].idx = 0;
+}
+
+// settles path[depth] with everything in cells, true when the parent took the new dividers,
+// false when they left the parent overfull and cells hold the parent's content to settle next
+bool Balancer::balance(size_t depth) {
+    if (depth == 0) {
+        deepen_root();
+        depth = 1;
+    }
+
+    BTreePage parent(db, path[depth - 1].pg_n);
+    uint16_t n_cells = parent.header.num_of_cells;
+    uint16_t idx = path[depth - 1].idx;
+    uint16_t first = idx > 0 ? idx - 1 : 0;
+    uint16_t last = std::min<uint16_t>(n_cells, first + 2);
+    first = last >= 2 ? last - 2 : 0;
+
+    // table leaves keep every rowid in their cells, the dividers above them are only copies of the last ones,
+    // anywhere else a divider is a cell of its own which moves down between its two pages and back up
+    bool is_table_leaf = page_type == BTreePageType::LeafTableBTreePage;
+    bool is_interior = page_type == BTreePageType::InteriorTableBTreePage || page_type == BTreePageType::InteriorIndexBTreePage;
+
+    Cells all;
+    std::vector<uint32_t> old_pg_ns;
+    uint32_t right_most = 0;
+    BTreePage sibling(db);
+    for (uint16_t j = first; j <= last; ++j) {
+        uint32_t pg_n = j < n_cells ? parent.get_cell_left_child_pointer(parent.get_cell_content_offset(j)) : parent.get_right_most_pointer();
+        old_pg_ns.push_back(pg_n);
+        if (j == idx) {
+            all.bytes.reserve(all.bytes.size() + cells.bytes.size());
+            for (size_t i = 0; i < cells.size(); ++i) {
+                all.add(cells.get(i), cells.get_size(i));
+            }
+            right_most = right_most_pointer;
+        } else {
+            sibling.recreate(pg_n);
+            all.add_page(sibling, 0, sibling.header.num_of_cells);
+            right_most = sibling.get_right_most_pointer();
+        }
+        if (j < last && !is_table_leaf) {
+            uint16_t cell_content_offset = parent.get_cell_content_offset(j);
+            uint32_t cell_size = parent.get_cell_size(cell_content_offset);
+            if (is_interior) {
+                all.add(right_most, parent.bytes + cell_content_offset + 4, cell_size - 4);
+            } else {
+                all.add(parent.bytes + cell_content_offset + 4, cell_size - 4);
+            }
+        }
+    }
+
+    size_t n = all.size();
+    std::vector<uint32_t> sums(n + 1, 0); // cell sizes with their cell pointers
+    for (size_t i = 0; i < n; ++i) {
+        sums[i + 1] = sums[i] + all.get_size(i) + 2;
+    }
+
+    // starts[k] is the first cell of new page k, the cell before it is the divider unless these are table leaves
+    uint32_t capacity = db->get_U() - (is_interior ? 12 : 8);
+    std::vector<size_t> starts{0};
+    size_t i = 0;
+    for (;;) {
+        size_t from = i;
+        while (i < n && sums[i + 1] - sums[from] <= capacity) {
+            ++i;
+        }
+        if (i == n) {
+            break;
+        }
+        if (!is_table_leaf) {
+            ++i;
+        }
+        starts.push_back(i);
+    }
+    size_t n_pages = starts.size();
+    auto page_end = [&](size_t k) {
+        return k + 1 < n_pages ? starts[k + 1] - (is_table_leaf ? 0 : 1) : n;
+    };
+
+    // the greedy pass leaves the last page with what is left over, cells move right while that evens things out,
+    // an append only makes sure the last page isn't empty, more cells will follow there
+    for (size_t k = n_pages - 1; k > 0; --k) {
+        for (;;) {
+            size_t left_end = page_end(k - 1);
+            if (left_end - starts[k - 1] < 2) {
+                break;
+            }
+            size_t moving = is_table_leaf ? left_end - 1 : starts[k] - 1;
+            uint32_t right_size = sums[page_end(k)] - sums[starts[k]];
+            uint32_t new_right_size = right_size + sums[moving + 1] - sums[moving];
+            uint32_t new_left_size = sums[left_end - 1] - sums[starts[k - 1]];
+            if (right_size != 0 && (append || new_right_size > new_left_size)) {
+                break;
+            }
+            --starts[k];
+        }
+    }
+
+    std::vector<uint32_t> new_pg_ns(n_pages);
+    for (size_t k = 0; k < n_pages; ++k) {
+        new_pg_ns[k] = k < old_pg_ns.size() ? old_pg_ns[k] : db->allocate_page();
+    }
+    for (size_t k = n_pages; k < old_pg_ns.size(); ++k) {
+        db->free_page(old_pg_ns[k]);
+    }
+
+    BTreePage page(db);
+    page.header.page_type = page_type;
+    for (size_t k = 0; k < n_pages; ++k) {
+        uint32_t page_right_most = 0;
+        if (is_interior) {
+            if (k + 1 < n_pages) {
+                read_big_endian32(&page_right_most, all.get(starts[k + 1] - 1));
+            } else {
+                page_right_most = right_most;
+            }
+        }
+        fill(page, all, starts[k], page_end(k), page_right_most);
+        db->write(new_pg_ns[k], page.bytes);
+    }
+
+    // in the parent the old dividers give way to the new ones, the pointer that led to the last sibling
+    // leads to the last new page
+    Cells upper;
+    upper.add_page(parent, 0, first);
+    for (size_t k = 0; k + 1 < n_pages; ++k) {
+        if (is_table_leaf) {
+            uint8_t key[9];
+            upper.add(new_pg_ns[k], key, write_varint(all.get_leaf_rowid(page_end(k) - 1), key));
+        } else if (is_interior) {
+            size_t divider = starts[k + 1] - 1;
+            upper.add(new_pg_ns[k], all.get(divider) + 4, all.get_size(divider) - 4);
+        } else {
+            size_t divider = starts[k + 1] - 1;
+            upper.add(new_pg_ns[k], all.get(divider), all.get_size(divider));
+        }
+    }
+    upper.add_page(parent, last, n_cells);
+    uint32_t parent_right_most = parent.get_right_most_pointer();
+    if (last < n_cells) {
+        write_big_endian32(new_pg_ns[n_pages - 1], upper.get(first + n_pages - 1));
+    } else {
+        parent_right_most = new_pg_ns[n_pages - 1];
+    }
+
+    return settle_parent(depth, parent, upper, parent_right_most);
+}
+
+// the leaf keeps every old cell, only the new last one goes to a new right-most leaf
+bool Balancer::balance_quick(size_t depth) {
+    if (depth == 0) {
+        deepen_root();
+        depth = 1;
+    }
+    BTreePage parent(db, path[depth - 1].pg_n);
+    size_t n = cells.size();
+    uint32_t leaf_pg_n = path[depth].pg_n;
+    rightmost_leaf_pg_n = db->allocate_page();
+
+    BTreePage page(db);
+    page.header.page_type = page_type;
+    fill(page, cells, 0, n - 1, 0);
+    db->write(leaf_pg_n, page.bytes);
+    fill(page, cells, n - 1, n, 0);
+    db->write(rightmost_leaf_pg_n, page.bytes);
+
+    Cells upper;
+    upper.add_page(parent, 0, parent.header.num_of_cells);
+    uint8_t key[9];
+    upper.add(leaf_pg_n, key, write_varint(cells.get_leaf_rowid(n - 2), key));
+    return settle_parent(depth, parent, upper, rightmost_leaf_pg_n);
+}
+
+// writes upper as the parent of path[depth] when it fits, otherwise it becomes the next page to settle
+bool Balancer::settle_parent(size_t depth, BTreePage& parent, Cells& upper, uint32_t parent_right_most) {
+    uint32_t upper_size = parent.get_header_size() + upper.bytes.size() + 2 * upper.size();
+    if (upper_size <= db->get_U()) {
+        fill(parent, upper, 0, upper.size(), parent_right_most);
+        db->write(path[depth - 1].pg_n, parent.bytes);
+        return true;
+    }
+    cells = std::move(upper);
+    page_type = parent.header.page_type;
+    right_most_pointer = parent_right_most;
+    path.resize(depth);
+    return false;
+}
+
+// after a delete: path.back() holds cells, too few of them, the parents above are checked in turn
+void Balancer::shrink() {
+    while (path.size() > 1) {
+        size_t depth = path.size() - 1;
+        if (!balance(depth)) {
+            // the dividers can still overflow the parent when keys got longer, it is split as after an insert
+            while (!balance(path.size() - 1)) {
+            }
+            return;
+        }
+        path.resize(depth);
+        BTreePage parent(db, path.back().pg_n);
+        if (path.size() == 1 || !parent.is_underfull()) {
+            break;
+        }
+        cells = Cells();
+        cells.add_page(parent, 0, parent.header.num_of_cells);
+        page_type = parent.header.page_type;
+        right_most_pointer = parent.get_right_most_pointer();
+    }
+    make_shallower();
+}
+
+// a root left with no cells and a single child takes over the content of the child, as long as it fits there
+void Balancer::make_shallower() {
+    BTreePage root(db, path[0].pg_n);
+    BTreePage child(db);
+    while (root.header.page_type == BTreePageType::InteriorTableBTreePage && root.header.num_of_cells == 0) {
+        uint32_t child_pg_n = root.get_right_most_pointer();
+        child.recreate(child_pg_n);
+        uint32_t used = db->get_U() - child.compute_unused_space();
+        if (used + (root.is_first_page ? 100 : 0) > db->get_U()) {
+            return;
+        }
+        Cells content;
+        content.add_page(child, 0, child.header.num_of_cells);
+        root.header.page_type = child.header.page_type;
+        fill(root, content, 0, content.size(), child.get_right_most_pointer());
+        db->write(path[0].pg_n, root.bytes);
+        db->free_page(child_pg_n);
+    }
+}
+
+// the cell goes and its bytes join the freeblocks of the leaf, its overflow pages go to the freelist
+// a leaf left less than a third full is merged with its siblings by Balancer::shrink
+ReturnCodes DB::remove(uint32_t root_pg_n, uint64_t id) {
+    uint32_t current_pg_n = root_pg_n;
+    BTreePage current_page(this, current_pg_n);
+    std::vector<Balancer::Level> path;
+
+    while (current_page.header.page_type != BTreePageType::LeafTableBTreePage) {
+        uint16_t idx = current_page.lower_bound(id);
+        path.push_back({current_pg_n, idx});
+
+        if (idx != current_page.header.num_of_cells) {
+            current_pg_n = current_page.get_cell_left_child_pointer(current_page.get_cell_content_offset(idx));
+        } else {
+            current_pg_n = current_page.get_right_most_pointer();
+        }
+        current_page.recreate(current_pg_n);
+    }
+
+    uint16_t idx = current_page.lower_bound(id);
+    if (idx == current_page.header.num_of_cells) {
+        return ReturnCodes::CellNotFound;
+    }
+    uint16_t cell_content_offset = current_page.get_cell_content_offset(idx);
+    if (current_page.get_cell_rowid(cell_content_offset) != id) {
+        return ReturnCodes::CellNotFound;
+    }
+
+    uint32_t first_overflow_pg_n = current_page.get_cell_first_overflow_page(cell_content_offset);
+    if (first_overflow_pg_n != 0) {
+        uint64_t P = current_page.get_cell_payload_size(cell_content_offset);
+        free_overflow(first_overflow_pg_n, P - current_page.compute_directly_stored_payload_size(P));
+    }
+    current_page.drop_cell(idx);
+    write(current_pg_n, current_page.bytes);
+    rightmost_leaves.erase(root_pg_n);
+
+    if (!path.empty() && current_page.is_underfull()) {
+        path.push_back({current_pg_n, 0});
+        Balancer balancer(this, path, BTreePageType::LeafTableBTreePage);
+        balancer.cells.add_page(current_page, 0, current_page.header.num_of_cells);
+        balancer.shrink();
+    }
+    return ReturnCodes::CellDeleted;
+}
+
+// frees the chain holding n_bytes of payload, every page but the last names the next one
+void DB::free_overflow(uint32_t pg_n, uint64_t n_bytes) {
+    uint32_t n_bytes_per_page = get_U() - 4;
+    uint64_t n_pages = (n_bytes + n_bytes_per_page - 1) / n_bytes_per_page;
+    uint8_t* bytes = pool.alloc();
+    for (; n_pages > 1 && pg_n != 0; --n_pages) {
+        read_page(pg_n, bytes);
+        free_page(pg_n);
+        read_big_endian32(&pg_n, bytes);
+    }
+    free_page(pg_n);
+    pool.free(bytes);
+}
+
+// rowids in [low, high] go with no cell decoded away from the two boundary paths: the children in between
+// are unlinked from their parents and whole subtrees go to the freelist, then both paths are settled
+void DB::remove_range(uint32_t root_pg_n, uint64_t low, uint64_t high) {
+    if (low > high) {
+        return;
+    }
+    rightmost_leaves.erase(root_pg_n);
+
+    if (clear_range(root_pg_n, low, high)) {
+        std::vector<Balancer::Level> path{{root_pg_n, 0}};
+        Balancer balancer(this, path, BTreePageType::LeafTableBTreePage);
+        BTreePage root(this, root_pg_n);
+        root.header.page_type = BTreePageType::LeafTableBTreePage;
+        balancer.fill(root, balancer.cells, 0, 0, 0);
+        write(root_pg_n, root.bytes);
+        return;
+    }
+
+    settle_range(root_pg_n, low);
+    settle_range(root_pg_n, high);
+    std::vector<Balancer::Level> path{{root_pg_n, 0}};
+    Balancer(this, path, BTreePageType::LeafTableBTreePage).make_shallower();
+}
+
+// true when nothing is left under pg_n, the caller frees the page itself then
+// only children a and b holding low and high are visited, the ones between them lie wholly inside the range
+bool DB::clear_range(uint32_t pg_n, uint64_t low, uint64_t high) {
+    BTreePage page(this, pg_n);
+    uint16_t n_cells = page.header.num_of_cells;
+
+    if (page.header.page_type == BTreePageType::LeafTableBTreePage) {
+        uint16_t from = page.lower_bound(low);
+        uint16_t to = high == UINT64_MAX ? n_cells : page.lower_bound(high + 1);
+        for (uint16_t idx = from; idx < to; ++idx) {
+            uint16_t cell_content_offset = page.get_cell_content_offset(idx);
+            uint32_t first_overflow_pg_n = page.get_cell_first_overflow_page(cell_content_offset);
+            if (first_overflow_pg_n != 0) {
+                uint64_t P = page.get_cell_payload_size(cell_content_offset);
+                free_overflow(first_overflow_pg_n, P - page.compute_directly_stored_payload_size(P));
+            }
+        }
+        for (uint16_t idx = to; idx > from; --idx) {
+            page.drop_cell(idx - 1);
+        }
+        if (from != to) {
+            write(pg_n, page.bytes);
+        }
+        return page.header.num_of_cells == 0;
+    }
+
+    auto child = [&](uint16_t j) {
+        return j < n_cells ? page.get_cell_left_child_pointer(page.get_cell_content_offset(j)) : page.get_right_most_pointer();
+    };
+    uint16_t a = page.lower_bound(low);
+    uint16_t b = page.lower_bound(high);
+
+    // children [first, end) go away, the boundary ones only when they came out empty
+    uint16_t first = a + 1, end = b;
+    if (clear_range(child(a), low, high)) {
+        free_page(child(a));
+        first = a;
+        end = std::max<uint16_t>(end, a + 1);
+    }
+    if (b != a && clear_range(child(b), low, high)) {
+        free_page(child(b));
+        end = b + 1;
+    }
+    if (first >= end) {
+        return false;
+    }
+    for (uint16_t j = first; j < end; ++j) {
+        if (j != a && j != b) {
+            free_subtree(child(j));
+        }
+    }
+
+    if (end <= n_cells) {
+        for (uint16_t j = first; j < end; ++j) {
+            page.drop_cell(first);
+        }
+    } else if (first > 0) {
+        // the child left of the run becomes the right-most one, its divider goes with the run
+        page.header.right_most_pointer = child(first - 1);
+        for (uint16_t j = first - 1; j < n_cells; ++j) {
+            page.drop_cell(first - 1);
+        }
+    } else {
+        return true;
+    }
+    write(pg_n, page.bytes);
+    return false;
+}
+
+// the pages along the way to a boundary can be left underfull at any level, the deepest one goes to shrink,
+// which carries on upwards, until no page on the way is underfull any more
+// a page too big to merge with anything stays underfull, the passes stop after twice as many as there are levels
+void DB::settle_range(uint32_t root_pg_n, uint64_t id) {
+    BTreePage page(this);
+    size_t n_passes = 0;
+    for (size_t pass = 0; pass == 0 || pass < n_passes; ++pass) {
+        std::vector<Balancer::Level> path;
+        size_t underfull = 0;
+        uint32_t current_pg_n = root_pg_n;
+        page.recreate(current_pg_n);
+        while (page.header.page_type == BTreePageType::InteriorTableBTreePage) {
+            if (!path.empty() && page.is_underfull()) {
+                underfull = path.size();
+            }
+            uint16_t idx = page.lower_bound(id);
+            path.push_back({current_pg_n, idx});
+            current_pg_n = idx < page.header.num_of_cells ? page.get_cell_left_child_pointer(page.get_cell_content_offset(idx)) : page.get_right_most_pointer();
+            page.recreate(current_pg_n);
+        }
+        if (!path.empty() && page.is_underfull()) {
+            underfull = path.size();
+        }
+        path.push_back({current_pg_n, 0});
+        if (pass == 0) {
+            n_passes = 2 * path.size();
+        }
+        if (underfull == 0) {
+            return;
+        }
+
+        path.resize(underfull + 1);
+        page.recreate(path.back().pg_n);
+        Balancer balancer(this, path, page.header.page_type);
+        balancer.cells.add_page(page, 0, page.header.num_of_cells);
+        balancer.right_most_pointer = page.get_right_most_pointer();
+        balancer.shrink();
+    }
+}
+
+// every page under pg_n and pg_n itself go to the freelist, leaves are read only for their overflow chains
+void DB::free_subtree(uint32_t pg_n) {
+    BTreePage page(this);
+    std::stack<uint32_t> stack;
+    stack.push(pg_n);
+    while (!stack.empty()) {
+        uint32_t current_pg_n = stack.top();
+        stack.pop();
+        page.recreate(current_pg_n);
+        if (page.header.page_type == BTreePageType::InteriorTableBTreePage) {
+            page.prefetch_children();
+            stack.push(page.get_right_most_pointer());
+            for (uint16_t idx = 0; idx < page.header.num_of_cells; ++idx) {
+                stack.push(page.get_cell_left_child_pointer(page.get_cell_content_offset(idx)));
+            }
+        } else {
+            for (uint16_t idx = 0; idx < page.header.num_of_cells; ++idx) {
+                uint16_t cell_content_offset = page.get_cell_content_offset(idx);
+                uint32_t first_overflow_pg_n = page.get_cell_first_overflow_page(cell_content_offset);
+                if (first_overflow_pg_n != 0) {
+                    uint64_t P = page.get_cell_payload_size(cell_content_offset);
+                    free_overflow(first_overflow_pg_n, P - page.compute_directly_stored_payload_size(P));
+                }
+            }
+        }
+        free_page(current_pg_n);
+    }
+}
+
+// lays out cells [first, last) of from as the whole content of page, the header of page 1 stays
+void Balancer::fill(BTreePage& page, Cells& from, size_t first, size_t last, uint32_t right_most) {
+    uint32_t start = page.is_first_page ? 100 : 0;
+    std::memset(page.bytes + start, 0, db->get_page_size() - start);
+    page.recreate(page.header.page_type);
+    page.header.num_of_cells = last - first;
+    page.header.right_most_pointer = right_most;
+    for (size_t i = first; i < last; ++i) {
+        page.header.start_of_cell_content_area -= from.get_size(i);
+        std::memcpy(page.bytes + page.header.start_of_cell_content_area, from.get(i), from.get_size(i));
+        page.write_cell_content_offset(i - first, page.header.start_of_cell_content_area);
+    }
+    page.write_header();
+}
+
+ReturnCodes DB::find(uint32_t root_pg_n, uint64_t id, Payload* p) {
+    uint32_t current_pg_n = find_resident(root_pg_n, id);
+    BTreePage current_page(this, current_pg_n);
+
+    while (current_page.header.page_type != BTreePageType::LeafTableBTreePage) {
+        uint16_t idx = current_page.lower_bound(id);
+
+        if (idx != current_page.header.num_of_cells) {
+            uint16_t cell_content_offset = current_page.get_cell_content_offset(idx);
+            uint32_t left_child_pointer = current_page.get_cell_left_child_pointer(cell_content_offset);
+            current_pg_n = left_child_pointer;
+        } else {
+            current_pg_n = current_page.get_right_most_pointer();
+        }
+
+        current_page.recreate(current_pg_n);
+    }
+
+    uint16_t idx = current_page.lower_bound(id);
+
+    if (idx == current_page.header.num_of_cells) {
+        return ReturnCodes::CellNotFound;
+    }
+
+    uint16_t cell_content_offset = current_page.get_cell_content_offset(idx);
+    uint64_t rowid = current_page.get_cell_rowid(cell_content_offset);
+
+    if (rowid != id) {
+        return ReturnCodes::CellNotFound;
+    }
+    
+    current_page.read_cell(cell_content_offset, p);
+    return ReturnCodes::CellFound;
+}
+
+// keeps the interior levels of the table resident, its leaves are still read through the page cache
+bool DB::set_resident(const std::string& table_name, bool enabled) {
+    auto it = tables.find(table_name);
+    if (it == tables.end()) {
+        return false;
+    }
+    std::lock_guard<std::shared_mutex> lock(resident_mutex);
+    if (enabled) {
+        resident[it->second.root_pg_n].stale = true; // decoded by the first find
+    } else {
+        resident.erase(it->second.root_pg_n);
+    }
+    return true;
+}
+
+// level by level down to the parents of the leaves, the height comes from the left-most path
+// so the leaves themselves are never read, caller holds resident_mutex exclusively
+void DB::load_resident(uint32_t root_pg_n, ResidentTree& tree) {
+    tree.nodes.clear();
+    tree.stale = false;
+    BTreePage page(this, root_pg_n);
+    uint32_t height = 0;
+    while (page.header.page_type == BTreePageType::InteriorTableBTreePage) {
+        ++height;
+        page.recreate(page.header.num_of_cells != 0 ? page.get_cell_left_child_pointer(page.get_cell_content_offset(0)) : page.get_right_most_pointer());
+    }
+
+    std::vector<uint32_t> level{root_pg_n}, next;
+    for (uint32_t depth = 0; depth < height; ++depth) {
+        next.clear();
+        for (uint32_t pg_n : level) {
+            page.recreate(pg_n);
+            if (page.header.page_type != BTreePageType::InteriorTableBTreePage) {
+                continue; // find reads it like any other page not resident
+            }
+            if (depth == 0) {
+                page.prefetch_children();
+            }
+            ResidentNode& node = tree.nodes[pg_n];
+            node.keys.reserve(page.header.num_of_cells);
+            node.children.reserve(page.header.num_of_cells + 1);
+            for (uint16_t idx = 0; idx < page.header.num_of_cells; ++idx) {
+                uint16_t cell_content_offset = page.get_cell_content_offset(idx);
+                node.keys.push_back(page.get_cell_rowid(cell_content_offset));
+                node.children.push_back(page.get_cell_left_child_pointer(cell_content_offset));
+            }
+            node.children.push_back(page.get_right_most_pointer());
+            next.insert(next.end(), node.children.begin(), node.children.end());
+        }
+        level.swap(next);
+    }
+}
+
+// descends the resident levels, returns the first page find has to read, the root when the table isn't resident
+uint32_t DB::find_resident(uint32_t root_pg_n, uint64_t id) {
+    std::shared_lock<std::shared_mutex> lock(resident_mutex);
+    auto it = resident.find(root_pg_n);
+    if (it == resident.end()) {
+        return root_pg_n;
+    }
+    if (it->second.stale) {
+        lock.unlock();
+        {
+            std::lock_guard<std::shared_mutex> exclusive(resident_mutex);
+            it = resident.find(root_pg_n);
+            if (it != resident.end() && it->second.stale) {
+                load_resident(root_pg_n, it->second);
+            }
+        }
+        lock.lock();
+        it = resident.find(root_pg_n);
+        if (it == resident.end()) {
+            return root_pg_n;
+        }
+    }
+
+    uint32_t pg_n = root_pg_n;
+    auto node = it->second.nodes.find(pg_n);
+    while (node != it->second.nodes.end()) {
+        // same as BTreePage::lower_bound: the first key not less than id, past the end means the right-most child
+        const std::vector<uint64_t>& keys = node->second.keys;
+        pg_n = node->second.children[std::lower_bound(keys.begin(), keys.end(), id) - keys.begin()];
+        node = it->second.nodes.find(pg_n);
+    }
+    return pg_n;
+}
+
+void DB::invalidate_resident(uint32_t pg_n) {
+    std::lock_guard<std::shared_mutex> lock(resident_mutex);
+    for (auto& pair : resident) {
+        if (pair.first == pg_n || pair.second.nodes.count(pg_n) != 0) {
+            pair.second.stale = true;
+        }
+    }
+}
+
+void DB::print_tree(uint32_t root_pg_n) {
+    if (header.database_size_in_pages <= 1) {
+        return;
+    }
+
+    BTreePage root(this, root_pg_n);
+    if (root.header.page_type != BTreePageType::InteriorTableBTreePage) {
+        root.print();
+        return;
+    }
+
+    uint16_t offset = root.get_header_size();
+    root.print_header();
+    uint64_t rowid;
+    uint32_t left_child_pointer;
+    uint16_t cell_content_offset;
+    for (int i = 0; i < root.header.num_of_cells; ++i) {
+        read_big_endian16(&cell_content_offset, root.bytes + offset + 2 * i);
+        read_big_endian32(&left_child_pointer, root.bytes + cell_content_offset);
+        std::cout << "\t\t/ [" << left_child_pointer << "]\t";
+
+        BTreePage leaf(this, left_child_pointer);
+        leaf.print_cell_offsets_array();
+
+        std::cout << "\n";
+
+        read_varint(&rowid, root.bytes + cell_content_offset + 4);
+        std::cout << "[" << rowid << "]\n";
+    }
+
+    std::cout << "\t\t\\ [" << root.get_right_most_pointer() << "]\t";
+    BTreePage leaf(this, root.get_right_most_pointer());
+    leaf.print_cell_offsets_array();
+    std::cout << "\n";
+}
+
+// empty when everything is fine, gives up after max_errors problems
+// n_threads == 0 uses every core, pages are read through the page cache like any other reader's
+std::vector<std::string> DB::integrity_check(unsigned n_threads, size_t max_errors) {
+    if (n_threads == 0) {
+        n_threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    IntegrityCheck check(this, n_threads, max_errors);
+    return check.run();
+}
+
+IntegrityCheck::IntegrityCheck(DB* db, unsigned n_threads, size_t max_errors):
+    db(db), n_threads(n_threads), max_errors(max_errors),
+    seen(db->header.database_size_in_pages + 1), leaf_depth(1 + db->tables.size() + db->indexes.size()) {
+    for (auto& depth : leaf_depth) {
+        depth = -1;
+    }
+}
+
+std::vector<std::string> IntegrityCheck::run() {
+    check_freelist();
+
+    std::vector<uint32_t> roots{1}; // sqlite_schema
+    for (auto& table : db->tables) {
+        roots.push_back(table.second.root_pg_n);
+    }
+    for (auto& index : db->indexes) {
+        roots.push_back(index.second.root_pg_n);
+    }
+    for (uint32_t tree = 0; tree < roots.size(); ++tree) {
+        if (mark(roots[tree], 0)) {
+            tasks.push_back({roots[tree], tree, 0, false, false, 0, 0});
+        }
+    }
+
+    std::vector<std::thread> threads;
+    for (unsigned i = 1; i < n_threads; ++i) {
+        threads.emplace_back(&IntegrityCheck::worker, this);
+    }
+    worker();
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    uint32_t pending_byte_pg_n = db->get_lock_byte_pg_n();
+    for (uint32_t pg_n = 2; pg_n <= db->header.database_size_in_pages && !stop; ++pg_n) {
+        if (seen[pg_n] == 0 && pg_n != pending_byte_pg_n) {
+            error("page " + std::to_string(pg_n) + " is never used");
+        }
     }
+    return std::move(errors);
+}
 
-    Parser parser(lexer, this, table_name);
-    Payload p;
+void IntegrityCheck::error(const std::string& message) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (errors.size() < max_errors) {
+        errors.push_back(message);
+    }
+    if (errors.size() >= max_errors) {
+        stop = true;
+    }
+}
 
-    bool res = parser.parse_values(&p);
+// claims pg_n for whoever references it from from_pg_n (0 for the header and schema),
+// false when it can't be followed: out of range or claimed before
+bool IntegrityCheck::mark(uint32_t pg_n, uint32_t from_pg_n) {
+    if (pg_n < 1 || pg_n > db->header.database_size_in_pages) {
+        error((from_pg_n != 0 ? "page " + std::to_string(from_pg_n) + ": " : "") + "invalid page number " + std::to_string(pg_n));
+        return false;
+    }
+    if (seen[pg_n].exchange(1, std::memory_order_relaxed) != 0) {
+        error((from_pg_n != 0 ? "page " + std::to_string(from_pg_n) + ": " : "") + "2nd reference to page " + std::to_string(pg_n));
+        return false;
+    }
+    return true;
+}
 
-    if (!res) {
-        std::cout << "bad values\n";
-        return;
+void IntegrityCheck::worker() {
+    for (;;) {
+        Task task;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait(lock, [this] { return !tasks.empty() || n_busy == 0; });
+            if (tasks.empty()) {
+                return;
+            }
+            task = tasks.back();
+            tasks.pop_back();
+            ++n_busy;
+        }
+        check_page(task);
+        std::lock_guard<std::mutex> lock(mutex);
+        if (--n_busy == 0 && tasks.empty()) {
+            cv.notify_all();
+        }
     }
+}
 
-    if (p.rowid == 0) {
-        std::cout << "everything wrong\n";
+// the page itself was claimed by its parent, the children are claimed here before anybody descends into them
+// index keys are records, only their structure is checked, not their order
+void IntegrityCheck::check_page(const Task& task) {
+    if (stop) {
+        return;
+    }
+    BTreePage page(db, task.pg_n);
+    std::string where = "page " + std::to_string(task.pg_n);
+    BTreePageType type = page.header.page_type;
+    if (type == BTreePageType::Invalid) {
+        error(where + ": invalid page type");
+        return;
+    }
+    bool is_table = type == BTreePageType::InteriorTableBTreePage || type == BTreePageType::LeafTableBTreePage;
+    bool is_interior = type == BTreePageType::InteriorTableBTreePage || type == BTreePageType::InteriorIndexBTreePage;
+    uint32_t U = db->get_U();
+    uint32_t n_cells = page.header.num_of_cells;
+    uint32_t content_start = page.header.start_of_cell_content_area;
+    if (content_start > U || page.get_header_size() + 2 * n_cells > content_start) {
+        error(where + ": cell pointer array of " + std::to_string(n_cells) + " cells overlaps the cell content area at " + std::to_string(content_start));
         return;
     }
 
-    ReturnCodes rc = insert(tables[table_name].root_pg_n, p.rowid, &p);
+    std::vector<std::pair<uint32_t, uint32_t>> used; // [start, end) of every cell and freeblock
+    used.reserve(n_cells + 4);
+    std::vector<Task> children;
+    bool has_prev = task.has_lower;
+    int64_t prev = task.lower;
+    for (uint32_t idx = 0; idx < n_cells; ++idx) {
+        uint32_t offset = page.get_cell_content_offset(idx);
+        if (offset < content_start || offset > U - 4) {
+            error(where + " cell " + std::to_string(idx) + ": offset " + std::to_string(offset) + " out of range " + std::to_string(content_start) + ".." + std::to_string(U - 4));
+            continue;
+        }
+        // the cell header is parsed from a padded copy, a damaged cell near the end of the page can't read past it
+        uint8_t cell[4 + 9 + 9] = {};
+        std::memcpy(cell, page.bytes + offset, std::min<uint32_t>(sizeof(cell), U - offset));
+        uint32_t pos = 0, child_pg_n = 0;
+        uint64_t P = 0, rowid = 0;
+        if (is_interior) {
+            pos += read_big_endian32(&child_pg_n, cell);
+        }
+        if (type != BTreePageType::InteriorTableBTreePage) {
+            pos += read_varint(&P, cell + pos);
+        }
+        if (is_table) {
+            pos += read_varint(&rowid, cell + pos);
+        }
+        uint32_t cell_size = page.compute_cell_size(rowid, P);
+        if (offset + cell_size > U) {
+            error(where + " cell " + std::to_string(idx) + ": extends off end of page");
+            continue;
+        }
+        used.push_back({offset, offset + std::max<uint32_t>(4, cell_size)}); // SQLite never allocates less than 4 bytes
+
+        if (type != BTreePageType::InteriorTableBTreePage) {
+            uint64_t local = page.compute_directly_stored_payload_size(P);
+            if (P > local) {
+                uint32_t first_overflow_pg_n;
+                read_big_endian32(&first_overflow_pg_n, page.bytes + offset + cell_size - 4);
+                check_overflow(first_overflow_pg_n, task.pg_n, P - local);
+            }
+        }
 
-    if (rc == ReturnCodes::RowidAlreadyInDatabase) {
-        std::cout << "cell with id already in database\n";
-        return;
+        int64_t key = static_cast<int64_t>(rowid);
+        if (is_table) {
+            // equal keys are legal on interior pages, the subtree between them is empty then
+            bool out_of_order = has_prev && (is_interior ? key < prev : key <= prev);
+            if (out_of_order || (task.has_upper && key > task.upper)) {
+                error(where + " cell " + std::to_string(idx) + ": rowid " + std::to_string(key) + " out of order");
+            }
+        }
+        if (is_interior && mark(child_pg_n, task.pg_n)) {
+            children.push_back({child_pg_n, task.tree, task.depth + 1, is_table && has_prev, is_table, prev, key});
+        }
+        if (is_table) {
+            has_prev = true;
+            prev = key;
+        }
+    }
+    if (is_interior && mark(page.get_right_most_pointer(), task.pg_n)) {
+        children.push_back({page.get_right_most_pointer(), task.tree, task.depth + 1, is_table && has_prev, is_table && task.has_upper, prev, task.upper});
     }
 
-    if (rc != ReturnCodes::CellInserted) {
-        std::cout << "everything wrong or triple split\n";
+    uint32_t freeblock = page.header.first_free_block;
+    while (freeblock != 0) {
+        if (freeblock < content_start || freeblock > U - 4) {
+            error(where + ": freeblock offset " + std::to_string(freeblock) + " out of range");
+            break;
+        }
+        uint16_t next, size;
+        read_big_endian16(&next, page.bytes + freeblock);
+        read_big_endian16(&size, page.bytes + freeblock + 2);
+        if (freeblock + size > U) {
+            error(where + ": freeblock at " + std::to_string(freeblock) + " extends off end of page");
+            break;
+        }
+        used.push_back({freeblock, freeblock + size});
+        if (next != 0 && next <= freeblock + size + 3) { // what lies between them would be a fragment to merge
+            error(where + ": freeblocks out of order or less than 4 bytes apart");
+            break;
+        }
+        freeblock = next;
+    }
+
+    // what neither cells nor freeblocks cover are fragments, the header keeps their total
+    std::sort(used.begin(), used.end());
+    uint32_t end = content_start, n_frag = 0;
+    bool overlap = false;
+    for (auto& range : used) {
+        if (range.first < end) {
+            error(where + ": multiple uses for byte " + std::to_string(range.first));
+            overlap = true;
+            break;
+        }
+        n_frag += range.first - end;
+        end = range.second;
+    }
+    n_frag += U - end;
+    if (!overlap && n_frag != page.header.num_of_fragmented_free_bytes_in_cell_content) {
+        error(where + ": fragmentation of " + std::to_string(n_frag) + " bytes reported as " + std::to_string(page.header.num_of_fragmented_free_bytes_in_cell_content));
+    }
+
+    if (!is_interior) {
+        int32_t depth = -1;
+        if (!leaf_depth[task.tree].compare_exchange_strong(depth, task.depth) && depth != static_cast<int32_t>(task.depth)) {
+            error(where + ": leaf at depth " + std::to_string(task.depth) + ", other leaves of the tree are at depth " + std::to_string(depth));
+        }
         return;
     }
+
+    std::vector<uint32_t> child_pages;
+    child_pages.reserve(children.size());
+    for (auto& child : children) {
+        child_pages.push_back(child.pg_n);
+    }
+    db->prefetch_pages(child_pages);
+
+    // hands all but the first child to idle threads while the queue runs low, descends into the rest itself
+    size_t n_own = children.size();
+    if (n_threads > 1 && children.size() > 1) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (tasks.size() < 4 * n_threads) {
+            tasks.insert(tasks.end(), children.begin() + 1, children.end());
+            n_own = 1;
+            cv.notify_all();
+        }
+    }
+    for (size_t i = 0; i < n_own; ++i) {
+        check_page(children[i]);
+    }
 }
 
-void DB::parse_schema() {
-    BTreePage schema(this);
-    Payload p;
-    std::stack<uint32_t> stack;
-    stack.push(1);
-    uint16_t cell_content_offset;
-    
-    while (!stack.empty()) {
-        schema.recreate(stack.top());
-        stack.pop();
-        
-        if (schema.header.page_type == BTreePageType::LeafTableBTreePage) {
-            for (uint16_t idx = 0; idx < schema.header.num_of_cells; ++idx) {
-                cell_content_offset = schema.get_cell_content_offset(idx);
-                schema.read_cell(cell_content_offset, &p);
-                std::string schema_type = p.get_text_column(1);
-                SchemaTypeColumn type = SCHEMA_TYPES[schema_type];
-                if (type == SchemaTypeColumn::Table) {
-                    std::string table_name = p.get_text_column(2);
-                    tables[table_name] = TableSchema();
-                    uint64_t root_pg_n = p.get_integer_column(4);
-                    tables[table_name].root_pg_n = root_pg_n;
-                    std::string sql = p.get_text_column(5);
-                    parse_create_table_sql(sql);
-                }
-            }
-        } else if (schema.header.page_type == BTreePageType::InteriorTableBTreePage) {
-            for (uint16_t idx = 0; idx < schema.header.num_of_cells; ++idx) {
-                cell_content_offset = schema.get_cell_content_offset(idx);
-                stack.push(schema.get_cell_left_child_pointer(cell_content_offset));
-            }
-            stack.push(schema.get_right_most_pointer());
+// the chain has to hold exactly the n_bytes of payload which didn't fit on the cell's page
+void IntegrityCheck::check_overflow(uint32_t pg_n, uint32_t cell_pg_n, uint64_t n_bytes) {
+    uint64_t content_size = db->get_U() - 4;
+    uint64_t n_expected = (n_bytes + content_size - 1) / content_size;
+    uint32_t from_pg_n = cell_pg_n;
+    for (uint64_t i = 0; i < n_expected; ++i) {
+        if (pg_n == 0) {
+            error("page " + std::to_string(cell_pg_n) + ": " + std::to_string(n_expected - i) + " of " + std::to_string(n_expected) + " pages missing from overflow list");
+            return;
+        }
+        if (!mark(pg_n, from_pg_n)) {
+            return;
         }
+        bool mapped;
+        const uint8_t* bytes = db->pin_page(pg_n, &mapped);
+        from_pg_n = pg_n;
+        read_big_endian32(&pg_n, bytes);
+        db->unpin_page(from_pg_n, mapped);
+    }
+    if (pg_n != 0) {
+        error("page " + std::to_string(from_pg_n) + ": extends off end of overflow list of page " + std::to_string(cell_pg_n));
     }
 }
 
-uint32_t DB::get_root_page_number(std::string& table_name) {
-    return tables[table_name].root_pg_n;
+// uncommitted frees and allocations make the chain on disk stale, the in-memory freelist is what counts then
+void IntegrityCheck::check_freelist() {
+    if (db->freelist.dirty) {
+        for (uint32_t pg_n : db->freelist.pages()) {
+            mark(pg_n, 0);
+        }
+        return;
+    }
+    uint32_t max_leaves = db->get_U() / 4 - 2;
+    uint32_t n_pages = 0;
+    uint32_t from_pg_n = 0;
+    uint32_t trunk = db->header.first_freelist_trunk_page;
+    while (trunk != 0 && mark(trunk, from_pg_n)) {
+        ++n_pages;
+        bool mapped;
+        const uint8_t* bytes = db->pin_page(trunk, &mapped);
+        uint32_t next, n_leaves;
+        read_big_endian32(&next, bytes);
+        read_big_endian32(&n_leaves, bytes + 4);
+        if (n_leaves > max_leaves) {
+            error("freelist trunk page " + std::to_string(trunk) + ": " + std::to_string(n_leaves) + " leaves, at most " + std::to_string(max_leaves) + " fit");
+            n_leaves = 0;
+        }
+        for (uint32_t i = 0; i < n_leaves; ++i) {
+            uint32_t leaf;
+            read_big_endian32(&leaf, bytes + 8 + 4 * i);
+            mark(leaf, trunk);
+            ++n_pages;
+        }
+        db->unpin_page(trunk, mapped);
+        from_pg_n = trunk;
+        trunk = next;
+    }
+    if (n_pages != db->header.total_freelist_pages) {
+        error("freelist size is " + std::to_string(n_pages) + " but should be " + std::to_string(db->header.total_freelist_pages));
+    }
 }
 
-bool DB::check_inheader_dbsize() {
-    return header.database_size_in_pages > 0 && header.file_change_counter == header.version_valid_for_number;
+bool DB::backup(const std::string& target_fn, bool incremental, Vfs* target_vfs) {
+    Backup backup(this, target_fn, incremental, target_vfs);
+    return backup.finish();
 }
 
-uint16_t DB::get_page_size() {
-    return header.page_size;
+// incremental only when the target is the file the last finished backup wrote and still holds its header and size,
+// a full copy otherwise: another file with the same change counter, an older copy say, would be left half updated
+Backup::Backup(DB* db, const std::string& target_fn, bool incremental, Vfs* target_vfs)
+    : db(db), target_fn(target_fn), target_vfs(target_vfs != nullptr ? target_vfs : db->vfs) {
+    target = this->target_vfs->open(target_fn, true);
+    if (target == nullptr) {
+        std::cerr << "cannot open backup file " << target_fn << "\n";
+        failed = true;
+        return;
+    }
+    uint32_t page_size = db->get_page_size();
+    buffer.resize(static_cast<size_t>(BACKUP_RUN_PAGES) * page_size);
+    first_page.resize(page_size);
+
+    // the base header's page count and page size give the size the target must still have
+    std::vector<uint8_t> target_header(DB_HEADER_SIZE);
+    bool same_target = target->read(0, target_header.data(), DB_HEADER_SIZE);
+    uint16_t target_page_size = 0;
+    uint32_t target_db_size = 0;
+    read_big_endian16(&target_page_size, target_header.data() + 16);
+    read_big_endian32(&target_db_size, target_header.data() + 28);
+    same_target = same_target && (target_page_size == 1 ? 65536 : target_page_size) == page_size
+        && target->size() == static_cast<uint64_t>(target_db_size) * page_size;
+
+    // one lock for the page count and the start of tracking, no commit slips in between
+    std::lock_guard<std::mutex> lock(db->cache_mutex);
+    read_committed(1, 1, first_page.data());
+    uint32_t db_size;
+    read_big_endian32(&db_size, first_page.data() + 28);
+    this->incremental = incremental && same_target && db->backup_base_valid && db->backup_base_fn == target_fn
+        && db->backup_base_vfs == this->target_vfs && db->backup_base_header == target_header;
+    if (this->incremental) {
+        pending.swap(db->backup_changed);
+        pending.insert(1);
+    } else {
+        db->backup_changed.clear();
+        for (uint32_t pg_n = 1; pg_n <= db_size; ++pg_n) {
+            pending.insert(pending.end(), pg_n);
+        }
+    }
+    db->backup_tracking = true;
+    db->backup_base_valid = false; // until finish, the target is half old and half new
 }
 
-uint16_t DB::get_U() {
-    return get_page_size() - header.unused_reserved_space;
+// locked when the caller holds cache_mutex already
+void Backup::take_changed(bool locked) {
+    std::unique_lock<std::mutex> lock(db->cache_mutex, std::defer_lock);
+    if (!locked) {
+        lock.lock();
+    }
+    pending.insert(db->backup_changed.begin(), db->backup_changed.end());
+    db->backup_changed.clear();
 }
 
-bool DB::check_split_is_enough(uint16_t split_idx, uint16_t num_of_cells, uint16_t* sums) {
-    return sums[split_idx] + 8 + 2 * (split_idx + 1) < get_U() && sums[num_of_cells] - sums[split_idx] + 8 + 2 * (num_of_cells - split_idx - 1) < get_U();
+// the run as last committed: the file, then log frames on top of it
+// caller holds cache_mutex, it keeps a commit or checkpoint from writing the same pages meanwhile
+void Backup::read_committed(uint32_t pg_n, uint32_t n_pages, uint8_t* bytes) {
+    uint32_t page_size = db->get_page_size();
+    db->file->read(static_cast<uint64_t>(pg_n - 1) * page_size, bytes, static_cast<size_t>(n_pages) * page_size);
+    if (!db->wal.is_open()) {
+        return;
+    }
+    for (uint32_t i = 0; i < n_pages; ++i) {
+        auto it = db->wal.index.find(pg_n + i);
+        if (it != db->wal.index.end()) {
+            db->wal.read_frame(it->second, bytes + static_cast<size_t>(i) * page_size);
+        }
+    }
 }
 
-ReturnCodes DB::insert(uint32_t root_pg_n, uint64_t id, Payload* payload) {
-    uint64_t rowid;
-    uint32_t left_child_pointer, right_most_pointer;
-    uint16_t cell_content_offset, idx;
+// page 1 goes last, an interrupted backup leaves the old header and so never passes for a finished one
+int64_t Backup::step(uint32_t n_pages) {
+    return copy(n_pages, false);
+}
 
-    uint32_t current_pg_n = root_pg_n;
-    BTreePage current_page(this, current_pg_n);
+// locked when the caller holds cache_mutex for the whole copy, no commit can add pages meanwhile
+int64_t Backup::copy(uint32_t n_pages, bool locked) {
+    if (failed) {
+        return -1;
+    }
+    take_changed(locked);
+    uint32_t page_size = db->get_page_size();
+    while (n_pages != 0 && !pending.empty()) {
+        auto it = pending.upper_bound(1);
+        if (it == pending.end()) {
+            it = pending.begin();
+        }
+        uint32_t first = *it, n = 0;
+        while (it != pending.end() && *it == first + n && n < BACKUP_RUN_PAGES && n < n_pages) {
+            it = pending.erase(it);
+            ++n;
+        }
+        {
+            std::unique_lock<std::mutex> lock(db->cache_mutex, std::defer_lock);
+            if (!locked) {
+                lock.lock();
+            }
+            read_committed(first, n, buffer.data());
+        }
+        if (first == 1) {
+            std::memcpy(first_page.data(), buffer.data(), page_size);
+        }
+        if (!target->write(static_cast<uint64_t>(first - 1) * page_size, buffer.data(), static_cast<size_t>(n) * page_size)) {
+            failed = true;
+            return -1;
+        }
+        n_pages -= n;
+    }
+    return pending.size();
+}
+
+// copies until a pass ends with nothing committed meanwhile, then the target matches the last commit
+// steady commits could keep that from ever happening, so after BACKUP_MAX_PASSES the pages changed
+// by then are copied under cache_mutex, commits wait for that one pass only
+// commits after the last pass stay in backup_changed for the next incremental backup
+bool Backup::finish() {
+    for (int pass = 1;; ++pass) {
+        if (pass == BACKUP_MAX_PASSES) {
+            std::lock_guard<std::mutex> lock(db->cache_mutex);
+            if (copy(UINT32_MAX, true) < 0) {
+                return false;
+            }
+            break;
+        }
+        if (step(UINT32_MAX) < 0) {
+            return false;
+        }
+        std::lock_guard<std::mutex> lock(db->cache_mutex);
+        if (db->backup_changed.empty()) {
+            break;
+        }
+    }
 
-    uint32_t parents[20];
-    uint8_t n_parents = 0;
+    uint32_t db_size;
+    read_big_endian32(&db_size, first_page.data() + 28);
+    if ((db_size != 0 && !target->truncate(static_cast<uint64_t>(db_size) * db->get_page_size())) || !target->sync()) {
+        std::cerr << "backup failed\n";
+        failed = true;
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(db->cache_mutex);
+    db->backup_base_fn = target_fn;
+    db->backup_base_vfs = target_vfs;
+    db->backup_base_header.assign(first_page.begin(), first_page.begin() + DB_HEADER_SIZE);
+    db->backup_base_valid = true;
+    return true;
+}
 
-    while (current_page.header.page_type != BTreePageType::LeafTableBTreePage) {
-        parents[n_parents] = current_pg_n;
-        n_parents++;
+// needs the database to itself: no transaction and no other threads using it meanwhile
+bool DB::vacuum() {
+    if (in_transaction) {
+        std::cout << "cannot VACUUM from within a transaction\n";
+        return false;
+    }
+    if (header.largest_root_b_tree_page != 0) {
+        std::cout << "cannot VACUUM an auto-vacuum database\n"; // its pointer map pages would have to move too
+        return false;
+    }
+    if (wal.is_open() && !checkpoint()) {
+        return false;
+    }
+    if (!begin()) {
+        return false;
+    }
+    Vacuum vacuum(this);
+    bool ok = vacuum.run();
+    in_transaction = false;
+    file->unlock();
+    return ok;
+}
 
-        idx = current_page.lower_bound(id);
+bool Vacuum::run() {
+    uint32_t page_size = db->get_page_size();
+    new_pg_n.assign(db->header.database_size_in_pages + 1, 0);
+    old_pg_n = {0, 1};
+    kinds = {Kind::BTree, Kind::Schema};
+    new_pg_n[1] = n_pages = 1;
+
+    collect_roots();
+    std::sort(roots.begin(), roots.end()); // so no root gets a larger number than it had
+    for (uint32_t root_pg_n : roots) {
+        place(root_pg_n, Kind::BTree);
+    }
+    place_tree(1, Kind::Schema);
+    for (uint32_t root_pg_n : roots) {
+        place_tree(root_pg_n, Kind::BTree);
+    }
+    if (!ok) {
+        std::cout << "database disk image is malformed\n";
+        return false;
+    }
 
-        if (idx != current_page.header.num_of_cells) {
-            cell_content_offset = current_page.get_cell_content_offset(idx);
-            left_child_pointer = current_page.get_cell_left_child_pointer(cell_content_offset);
-            current_pg_n = left_child_pointer;
-        } else {
-            current_pg_n = current_page.get_right_most_pointer();
+    std::string temp_fn = db->fn + "-vacuum";
+    std::unique_ptr<VfsFile> temp = db->vfs->open(temp_fn, true);
+    if (temp == nullptr || !temp->truncate(0)) {
+        std::cerr << "cannot open " << temp_fn << "\n";
+        return false;
+    }
+    std::vector<uint8_t> run(static_cast<size_t>(VACUUM_RUN_PAGES) * page_size);
+    BTreePage page(db);
+    for (uint32_t pg_n = 1; pg_n <= n_pages && ok; ++pg_n) {
+        uint32_t i = (pg_n - 1) % VACUUM_RUN_PAGES;
+        relink(pg_n, page, run.data() + static_cast<size_t>(i) * page_size);
+        if (i == VACUUM_RUN_PAGES - 1 || pg_n == n_pages) {
+            ok = temp->write(static_cast<uint64_t>(pg_n - 1 - i) * page_size, run.data(), static_cast<size_t>(i + 1) * page_size);
         }
-        current_page.recreate(current_pg_n);
+    }
+    if (!ok || !temp->sync() || !write_footer(*temp) || !temp->sync()) {
+        std::cerr << "VACUUM failed, the database is unchanged\n";
+        temp.reset();
+        db->vfs->remove(temp_fn);
+        return false;
     }
 
-    idx = current_page.lower_bound(id);
-    if (idx != current_page.header.num_of_cells) {
-        cell_content_offset = current_page.get_cell_content_offset(idx);
-        rowid = current_page.get_cell_rowid(cell_content_offset);
-        if (rowid == id) {
-            return ReturnCodes::RowidAlreadyInDatabase;
+    {
+        std::lock_guard<std::mutex> lock(db->cache_mutex);
+        if (db->ring.is_open()) {
+            db->reap_reads(UINT32_MAX);
+        }
+        ok = copy_back(*temp, n_pages, page_size);
+        db->cache.clear();
+        if (db->map != nullptr && db->map_pins == 0) {
+            db->remap();
         }
     }
-
-    ReturnCodes rc = current_page.insert_leaf_cell(id, idx, payload);
-    if (rc == ReturnCodes::CellInserted) {
-        write(current_pg_n, current_page.bytes);
-        return rc;
+    if (!ok) {
+        // the complete image is still in the temporary file, the next open copies it back
+        std::cerr << "VACUUM failed while copying " << temp_fn << " back, reopen the database to finish it\n";
+        return false;
     }
+    temp.reset();
+    db->vfs->remove(temp_fn);
+
+    db->read_header();
+    db->header.database_size_in_pages = n_pages;
+    db->load_freelist();
+    db->tables.clear();
+    db->indexes.clear();
+    db->parse_schema();
+    db->rightmost_leaves.clear();
+    std::lock_guard<std::shared_mutex> lock(db->resident_mutex);
+    std::map<uint32_t, DB::ResidentTree> resident;
+    for (auto& pair : db->resident) {
+        resident[renumber(pair.first)].stale = true;
+    }
+    db->resident.swap(resident);
+    db->backup_base_valid = false; // every page may have moved
+    return true;
+}
 
-    uint16_t sums[current_page.header.num_of_cells + 1];
-    uint16_t cell_sizes[current_page.header.num_of_cells + 1];
-    uint16_t cell_content_offsets[current_page.header.num_of_cells + 1];
-
-    cell_sizes[idx] = current_page.compute_cell_size(id, payload->P);
+// the magic, the number of pages and the page size, after the last page of the image
+bool Vacuum::write_footer(VfsFile& temp) {
+    uint8_t footer[16];
+    std::memcpy(footer, VACUUM_MAGIC, 8);
+    write_big_endian32(n_pages, footer + 8);
+    write_big_endian32(db->get_page_size(), footer + 12);
+    return temp.write(static_cast<uint64_t>(n_pages) * db->get_page_size(), footer, sizeof(footer));
+}
 
-    uint16_t split_idx = current_page.get_split_index(idx, sums, cell_sizes, cell_content_offsets);
-    uint64_t split_rowid = (split_idx == idx) ? id : current_page.get_cell_rowid(cell_content_offsets[split_idx]);
+// false for an image without its footer, which is one the database was never touched for
+bool Vacuum::read_footer(VfsFile& temp, uint32_t* image_n_pages, uint32_t* page_size) {
+    uint64_t size = temp.size();
+    uint8_t footer[16];
+    if (size < sizeof(footer) || !temp.read(size - sizeof(footer), footer, sizeof(footer)) || std::memcmp(footer, VACUUM_MAGIC, 8) != 0) {
+        return false;
+    }
+    read_big_endian32(image_n_pages, footer + 8);
+    read_big_endian32(page_size, footer + 12);
+    return size == static_cast<uint64_t>(*image_n_pages) * *page_size + sizeof(footer);
+}
 
-    BTreePage new_page(this, BTreePageType::LeafTableBTreePage);
+// writes the image over the database run by run, the database ends where the image does
+bool Vacuum::copy_back(VfsFile& temp, uint32_t image_n_pages, uint32_t page_size) {
+    std::vector<uint8_t> run(static_cast<size_t>(VACUUM_RUN_PAGES) * page_size);
+    bool copied = true;
+    for (uint32_t pg_n = 1; pg_n <= image_n_pages && copied; pg_n += VACUUM_RUN_PAGES) {
+        size_t n = static_cast<size_t>(std::min(VACUUM_RUN_PAGES, image_n_pages - pg_n + 1)) * page_size;
+        uint64_t offset = static_cast<uint64_t>(pg_n - 1) * page_size;
+        copied = temp.read(offset, run.data(), n) && db->file->write(offset, run.data(), n);
+    }
+    return copied && db->file->truncate(static_cast<uint64_t>(image_n_pages) * page_size) && db->file->sync();
+}
 
-    if (check_split_is_enough(split_idx, current_page.header.num_of_cells, sums)) {
+// called on open when fn-vacuum is there: a complete image is copied back again, as often as it takes,
+// an incomplete one is only removed. A VACUUM still running elsewhere holds the lock and is left alone
+bool Vacuum::recover() {
+    std::string temp_fn = db->fn + "-vacuum";
+    if (!db->file->lock(LockType::Exclusive)) {
+        return false;
+    }
+    std::unique_ptr<VfsFile> temp = db->vfs->open(temp_fn);
+    uint32_t image_n_pages, page_size;
+    bool recovered = temp != nullptr;
+    if (recovered && read_footer(*temp, &image_n_pages, &page_size)) {
+        recovered = copy_back(*temp, image_n_pages, page_size);
+    }
+    if (recovered) {
+        temp.reset();
+        db->vfs->remove(temp_fn);
+    } else {
+        std::cerr << "cannot copy " << temp_fn << " back\n";
+    }
+    db->file->unlock();
+    return recovered;
+}
 
-        for (uint16_t i = split_idx + 1; i < current_page.header.num_of_cells + 1; ++i) {
-            if (i == idx) {
-                ReturnCodes rc = new_page.insert_leaf_cell(id, new_page.header.num_of_cells, payload);
-                if (rc != ReturnCodes::CellInserted) {
-                    return ReturnCodes::EverythingWrong;
+// root pages of every table and index, views have none
+void Vacuum::collect_roots() {
+    BTreePage schema(db);
+    Payload p;
+    std::vector<uint32_t> level{1}, next;
+    while (!level.empty() && ok) {
+        next.clear();
+        for (uint32_t pg_n : level) {
+            schema.recreate(pg_n);
+            for (uint16_t idx = 0; idx < schema.header.num_of_cells; ++idx) {
+                uint16_t cell_content_offset = schema.get_cell_content_offset(idx);
+                if (schema.header.page_type == BTreePageType::InteriorTableBTreePage) {
+                    next.push_back(schema.get_cell_left_child_pointer(cell_content_offset));
+                } else if (schema.header.page_type == BTreePageType::LeafTableBTreePage) {
+                    schema.read_cell(cell_content_offset, &p);
+                    PayloadView record(p);
+                    uint64_t content_offset, content_size;
+                    // 0 of a view is stored without content bytes, get_integer_column would take it for the rowid
+                    if (!record.find_column(4, &content_offset, &content_size) || content_size == 0) {
+                        continue;
+                    }
+                    int64_t root_pg_n = record.get_integer_column(4);
+                    if (root_pg_n > 1) {
+                        roots.push_back(static_cast<uint32_t>(root_pg_n));
+                    }
+                } else {
+                    ok = false;
                 }
-            } else {
-                uint16_t cell_content_offset = new_page.header.start_of_cell_content_area - cell_sizes[i];
-                new_page.header.start_of_cell_content_area -= cell_sizes[i];
-                new_page.header.num_of_cells += 1;
-                new_page.write_cell_content_offset(new_page.header.num_of_cells - 1, cell_content_offset);
-                std::memcpy(new_page.bytes + cell_content_offset, current_page.bytes + cell_content_offsets[i], cell_sizes[i]);
+            }
+            if (schema.header.page_type == BTreePageType::InteriorTableBTreePage) {
+                next.push_back(schema.get_right_most_pointer());
             }
         }
-        new_page.write_header();
+        level.swap(next);
+    }
+}
 
-    } else {
-        std::cout << "triple split needed\n";
-        new_page.write_header();
-        return ReturnCodes::NotImplemented;
-    }
-
-    if (current_pg_n == root_pg_n) {
-        BTreePage leaf(this, BTreePageType::LeafTableBTreePage);
-        for (uint16_t i = 0; i <= split_idx; ++i) {
-            if (i == idx) {
-                ReturnCodes rc = leaf.insert_leaf_cell(id, idx, payload);
-                if (rc != ReturnCodes::CellInserted) {
-                    return ReturnCodes::EverythingWrong;
+// a page referenced twice or out of range means a damaged file, nothing gets written then
+void Vacuum::place(uint32_t pg_n, Kind kind) {
+    if (pg_n < 2 || pg_n >= new_pg_n.size() || new_pg_n[pg_n] != 0) {
+        ok = false;
+        return;
+    }
+    if (++n_pages == db->get_lock_byte_pg_n()) {
+        old_pg_n.push_back(0);
+        kinds.push_back(Kind::LockByte);
+        ++n_pages;
+    }
+    new_pg_n[pg_n] = n_pages;
+    old_pg_n.push_back(pg_n);
+    kinds.push_back(kind);
+}
+
+// level by level, so the last level placed are the leaves in key order
+void Vacuum::place_tree(uint32_t root_pg_n, Kind kind) {
+    BTreePage page(db);
+    std::vector<uint32_t> level{root_pg_n}, next;
+    while (!level.empty() && ok) {
+        next.clear();
+        for (uint32_t pg_n : level) {
+            if (pg_n != root_pg_n) {
+                place(pg_n, kind);
+            }
+            page.recreate(pg_n);
+            if (page.header.page_type == BTreePageType::Invalid) {
+                ok = false;
+                return;
+            }
+            place_overflow(page);
+            if (page.header.page_type == BTreePageType::InteriorTableBTreePage || page.header.page_type == BTreePageType::InteriorIndexBTreePage) {
+                for (uint16_t idx = 0; idx < page.header.num_of_cells; ++idx) {
+                    next.push_back(page.get_cell_left_child_pointer(page.get_cell_content_offset(idx)));
                 }
-            } else {
-                uint16_t cell_content_offset = leaf.header.start_of_cell_content_area - cell_sizes[i];
-                leaf.header.start_of_cell_content_area -= cell_sizes[i];
-                leaf.header.num_of_cells += 1;
-                leaf.write_cell_content_offset(leaf.header.num_of_cells - 1, cell_content_offset);
-                std::memcpy(leaf.bytes + cell_content_offset, current_page.bytes + cell_content_offsets[i], cell_sizes[i]);
+                next.push_back(page.get_right_most_pointer());
             }
         }
-        leaf.write_header();
+        level.swap(next);
+    }
+}
+
+// where the first overflow page number of the cell is stored, 0 when the payload is all on the page
+uint32_t Vacuum::get_overflow_offset(BTreePage& page, uint16_t offset, uint64_t* n_bytes) {
+    BTreePageType type = page.header.page_type;
+    if (type == BTreePageType::InteriorTableBTreePage) {
+        return 0;
+    }
+    uint32_t pos = offset + (type == BTreePageType::InteriorIndexBTreePage ? 4 : 0);
+    uint64_t P, rowid = 0;
+    pos += read_varint(&P, page.bytes + pos);
+    if (type == BTreePageType::LeafTableBTreePage) {
+        read_varint(&rowid, page.bytes + pos);
+    }
+    uint64_t local = page.compute_directly_stored_payload_size(P);
+    if (P <= local) {
+        return 0;
+    }
+    *n_bytes = P - local;
+    return offset + page.compute_cell_size(rowid, P) - 4;
+}
 
-        left_child_pointer = compute_database_size_in_pages() + 1;
-        right_most_pointer = compute_database_size_in_pages() + 2;
-        header.database_size_in_pages += 2;
-        write(left_child_pointer, leaf.bytes);
-        write(right_most_pointer, new_page.bytes);
+void Vacuum::place_overflow(BTreePage& page) {
+    uint32_t n_bytes_per_page = db->get_U() - 4;
+    for (uint16_t idx = 0; idx < page.header.num_of_cells && ok; ++idx) {
+        uint64_t n_bytes;
+        uint32_t pointer_offset = get_overflow_offset(page, page.get_cell_content_offset(idx), &n_bytes);
+        if (pointer_offset == 0) {
+            continue;
+        }
+        uint32_t pg_n;
+        read_big_endian32(&pg_n, page.bytes + pointer_offset);
+        for (uint64_t n = (n_bytes + n_bytes_per_page - 1) / n_bytes_per_page; n != 0 && ok; --n) {
+            place(pg_n, Kind::Overflow);
+            if (ok && n > 1) {
+                uint32_t next_pg_n;
+                bool mapped;
+                read_big_endian32(&next_pg_n, db->pin_page(pg_n, &mapped));
+                db->unpin_page(pg_n, mapped);
+                pg_n = next_pg_n;
+            }
+        }
+    }
+}
 
-        current_page.recreate(BTreePageType::InteriorTableBTreePage);
-        current_page.header.num_of_cells = 1;
-        current_page.header.start_of_cell_content_area -= current_page.compute_cell_size(split_rowid);
-        current_page.header.right_most_pointer = right_most_pointer;
+// copies the page to bytes with every page number in it replaced by the new one
+void Vacuum::relink(uint32_t pg_n, BTreePage& page, uint8_t* bytes) {
+    uint32_t page_size = db->get_page_size();
+    uint32_t pointer;
+    if (kinds[pg_n] == Kind::LockByte) {
+        std::memset(bytes, 0, page_size);
+        return;
+    }
+    if (kinds[pg_n] == Kind::Overflow) {
+        db->read_page(old_pg_n[pg_n], bytes);
+        read_big_endian32(&pointer, bytes);
+        write_big_endian32(renumber(pointer), bytes);
+        return;
+    }
 
-        current_page.write_header();
+    page.recreate(old_pg_n[pg_n]);
+    bool is_interior = page.header.page_type == BTreePageType::InteriorTableBTreePage || page.header.page_type == BTreePageType::InteriorIndexBTreePage;
+    for (uint16_t idx = 0; idx < page.header.num_of_cells; ++idx) {
+        uint16_t offset = page.get_cell_content_offset(idx);
+        if (is_interior) {
+            write_big_endian32(renumber(page.get_cell_left_child_pointer(offset)), page.bytes + offset);
+        }
+        uint64_t n_bytes;
+        uint32_t pointer_offset = get_overflow_offset(page, offset, &n_bytes);
+        if (pointer_offset != 0) {
+            read_big_endian32(&pointer, page.bytes + pointer_offset);
+            write_big_endian32(renumber(pointer), page.bytes + pointer_offset);
+        }
 
-        uint16_t offset = current_page.header.start_of_cell_content_area;
-        write_big_endian16(offset, current_page.bytes + current_page.get_header_size());
-        offset += write_big_endian32(left_child_pointer, current_page.bytes + offset);
-        offset += write_varint(split_rowid, current_page.bytes + offset);
-        write(current_pg_n, current_page.bytes);
-        return ReturnCodes::CellInserted;
-    } else {
-        write(current_pg_n, new_page.bytes);
-
-        new_page.recreate(BTreePageType::LeafTableBTreePage);
-        for (uint16_t i = 0; i <= split_idx; ++i) {
-            if (i == idx) {
-                ReturnCodes rc = new_page.insert_leaf_cell(id, idx, payload);
-                if (rc != ReturnCodes::CellInserted) {
-                    return ReturnCodes::EverythingWrong;
+        if (kinds[pg_n] == Kind::Schema && page.header.page_type == BTreePageType::LeafTableBTreePage) {
+            uint64_t P, rowid;
+            uint32_t pos = offset;
+            pos += read_varint(&P, page.bytes + pos);
+            pos += read_varint(&rowid, page.bytes + pos);
+            PayloadView record;
+            record.P = P;
+            record.bytes = page.bytes + pos;
+            uint64_t content_offset, content_size;
+            // the root page is an integer near the start of the record and its new number is never larger,
+            // so it fits the old serial type; a root column off the page is given up on rather than left stale
+            if (record.find_column(4, &content_offset, &content_size) && content_size != 0) {
+                if (content_size > 8 || content_offset + content_size > page.compute_directly_stored_payload_size(P)) {
+                    ok = false;
+                    return;
+                }
+                uint8_t* value = page.bytes + pos + content_offset;
+                uint64_t root_pg_n = 0;
+                for (uint64_t k = 0; k < content_size; ++k) {
+                    root_pg_n = root_pg_n << 8 | value[k];
+                }
+                root_pg_n = renumber(static_cast<uint32_t>(root_pg_n));
+                for (uint64_t k = content_size; k-- > 0; root_pg_n >>= 8) {
+                    value[k] = root_pg_n & 0xff;
                 }
-            } else {
-                uint16_t cell_content_offset = new_page.header.start_of_cell_content_area - cell_sizes[i];
-                new_page.header.start_of_cell_content_area -= cell_sizes[i];
-                new_page.header.num_of_cells += 1;
-                new_page.write_cell_content_offset(new_page.header.num_of_cells - 1, cell_content_offset);
-                std::memcpy(new_page.bytes + cell_content_offset, current_page.bytes + cell_content_offsets[i], cell_sizes[i]);
             }
         }
-        new_page.write_header();
+    }
+    if (is_interior) {
+        write_big_endian32(renumber(page.get_right_most_pointer()), page.bytes + (page.is_first_page ? 100 : 0) + 8);
+    }
+
+    if (pg_n == 1) {
+        uint32_t counter = db->header.file_change_counter + 1;
+        write_big_endian32(counter, page.bytes + 24);
+        write_big_endian32(n_pages, page.bytes + 28);
+        write_big_endian32(0, page.bytes + 32);
+        write_big_endian32(0, page.bytes + 36);
+        write_big_endian32(counter, page.bytes + 92);
+    }
+    std::memcpy(bytes, page.bytes, page_size);
+}
+
+// the table has to be empty, the loader runs in the open transaction or in its own one committed by finish
+BulkLoader::BulkLoader(DB* db, const std::string& table_name, double fill_factor): db(db), fill_factor(fill_factor) {
+    auto it = db->tables.find(table_name);
+    if (it == db->tables.end()) {
+        std::cout << "no table name " << table_name << " in schema\n";
+        failed = true;
+        return;
+    }
+    if (!(fill_factor > 0 && fill_factor <= 1)) {
+        std::cout << "fill factor has to be in (0, 1]\n";
+        failed = true;
+        return;
+    }
+    root_pg_n = it->second.root_pg_n;
+    BTreePage root(db, root_pg_n);
+    if (root.header.page_type != BTreePageType::LeafTableBTreePage || root.header.num_of_cells != 0) {
+        std::cout << "bulk load needs an empty table\n";
+        failed = true;
+        return;
+    }
+    if (!db->in_transaction) {
+        if (!db->begin()) {
+            failed = true;
+            return;
+        }
+        own_transaction = true;
+    }
+    run.resize(static_cast<size_t>(BULK_LOAD_RUN_PAGES) * db->get_page_size());
+    levels.push_back(std::make_unique<Level>(db, BTreePageType::LeafTableBTreePage));
+    reset(levels[0]->page);
+}
 
-        left_child_pointer = compute_database_size_in_pages() + 1;
-        header.database_size_in_pages += 1;
-        write(left_child_pointer, new_page.bytes);
+// an unfinished load leaves the table as it was
+BulkLoader::~BulkLoader() {
+    if (own_transaction && db->in_transaction) {
+        db->rollback();
     }
+}
 
-    while (current_pg_n != root_pg_n) {
+bool BulkLoader::fits(BTreePage& page, uint32_t cell_size) {
+    uint32_t U = db->get_U();
+    if (cell_size + 2 > page.compute_free_space()) {
+        return false;
+    }
+    uint32_t used = U - page.compute_free_space();
+    return page.header.num_of_cells == 0 || used + cell_size + 2 <= fill_factor * U;
+}
 
-        id = split_rowid;
-        n_parents--;
-        current_pg_n = parents[n_parents];
-        current_page.recreate(current_pg_n);
+void BulkLoader::reset(BTreePage& page) {
+    std::memset(page.bytes, 0, db->get_page_size());
+    page.recreate(page.header.page_type);
+}
 
-        idx = current_page.lower_bound(id);
-        ReturnCodes rc = current_page.insert_interior_cell(id, idx, left_child_pointer);
-        
-        if (rc == ReturnCodes::CellInserted) {
-            write(current_pg_n, current_page.bytes);
-            return ReturnCodes::CellInserted;
+// numbers the page and queues it for writing, the run is always consecutive pages
+uint32_t BulkLoader::append(const uint8_t* bytes) {
+    for (;;) {
+        if (run_n_pages == BULK_LOAD_RUN_PAGES) {
+            flush();
         }
-
-        split_idx = current_page.header.num_of_cells / 2;
-        if (split_idx < idx) {
-            split_rowid = current_page.get_cell_rowid(current_page.get_cell_content_offset(split_idx));
-            right_most_pointer = current_page.get_cell_left_child_pointer(current_page.get_cell_content_offset(split_idx));
-        } else if (split_idx == idx) {
-            split_rowid = id;
-            right_most_pointer = left_child_pointer;
-        } else {
-            split_rowid = current_page.get_cell_rowid(current_page.get_cell_content_offset(split_idx - 1));
-            right_most_pointer = current_page.get_cell_left_child_pointer(current_page.get_cell_content_offset(split_idx - 1));
+        uint32_t pg_n = ++db->header.database_size_in_pages;
+        if (run_n_pages == 0) {
+            run_first_pg_n = pg_n;
         }
-
-        new_page.recreate(BTreePageType::InteriorTableBTreePage);
-        for (uint16_t i = split_idx + 1; i < current_page.header.num_of_cells + 1; ++i) {
-            if (i < idx) {
-                cell_content_offset = current_page.get_cell_content_offset(i);
-                new_page.insert_interior_cell(i, current_page.get_cell_rowid(cell_content_offset), current_page.get_cell_left_child_pointer(cell_content_offset));
-            } else if (i == idx) {
-                new_page.insert_interior_cell(i, id, left_child_pointer);
-            } else {
-                cell_content_offset = current_page.get_cell_content_offset(i - 1);
-                new_page.insert_interior_cell(i, current_page.get_cell_rowid(cell_content_offset), current_page.get_cell_left_child_pointer(cell_content_offset));
-            }
+        uint8_t* page_bytes = run.data() + static_cast<size_t>(run_n_pages) * db->get_page_size();
+        ++run_n_pages;
+        if (pg_n != db->get_lock_byte_pg_n()) {
+            std::memcpy(page_bytes, bytes, db->get_page_size());
+            return pg_n;
         }
-        new_page.write_header();
-
+        std::memset(page_bytes, 0, db->get_page_size()); // the lock byte page goes to the file empty
+    }
+}
 
-        if (current_pg_n == root_pg_n) {
-            break;
+bool BulkLoader::flush() {
+    if (run_n_pages == 0) {
+        return true;
+    }
+    uint32_t page_size = db->get_page_size();
+    if (!db->file->write(static_cast<uint64_t>(run_first_pg_n - 1) * page_size, run.data(), static_cast<size_t>(run_n_pages) * page_size)) {
+        failed = true;
+    }
+    std::lock_guard<std::mutex> lock(db->cache_mutex);
+    for (uint32_t pg_n = run_first_pg_n; pg_n < run_first_pg_n + run_n_pages; ++pg_n) {
+        db->cache.invalidate(pg_n); // left over from a rolled back transaction, say
+        if (db->backup_tracking) {
+            db->backup_changed.insert(pg_n);
         }
+    }
+    run_n_pages = 0;
+    return !failed;
+}
 
-        write(current_pg_n, new_page.bytes);
+bool BulkLoader::add(Payload* payload) {
+    if (failed || finished) {
+        return false;
+    }
+    uint64_t rowid = payload->rowid;
+    if (n_rows != 0 && rowid <= last_rowid) {
+        std::cout << "bulk load needs increasing rowids, " << rowid << " after " << last_rowid << "\n";
+        return false;
+    }
+    BTreePage& leaf = levels[0]->page;
+    uint32_t cell_size = leaf.compute_cell_size(rowid, payload->P);
+    if (!fits(leaf, cell_size)) {
+        close_leaf();
+    }
 
-        new_page.recreate(BTreePageType::InteriorTableBTreePage);
-        new_page.header.right_most_pointer = right_most_pointer;
-        for (uint16_t i = 0; i < split_idx; ++i) {
-            if (i < idx) {
-                cell_content_offset = current_page.get_cell_content_offset(i);
-                new_page.insert_interior_cell(i, current_page.get_cell_rowid(cell_content_offset), current_page.get_cell_left_child_pointer(cell_content_offset));
-            } else if (i == idx) {
-                new_page.insert_interior_cell(i, id, left_child_pointer);
-            } else {
-                cell_content_offset = current_page.get_cell_content_offset(i - 1);
-                new_page.insert_interior_cell(i, current_page.get_cell_rowid(cell_content_offset), current_page.get_cell_left_child_pointer(cell_content_offset));
+    uint32_t local = leaf.compute_directly_stored_payload_size(payload->P);
+    uint32_t first_overflow_pg_n = 0;
+    if (local < payload->P) {
+        uint32_t n_bytes_per_page = db->get_U() - 4;
+        std::vector<uint8_t> overflow(db->get_page_size());
+        for (uint64_t done = local; done < payload->P; done += n_bytes_per_page) {
+            uint64_t n = std::min<uint64_t>(n_bytes_per_page, payload->P - done);
+            // pages are numbered in order, so the next one in the chain is the next page number past the lock byte page
+            uint32_t next_pg_n = db->header.database_size_in_pages + 2;
+            if (next_pg_n - 1 == db->get_lock_byte_pg_n() || next_pg_n == db->get_lock_byte_pg_n()) {
+                ++next_pg_n;
+            }
+            write_big_endian32(done + n < payload->P ? next_pg_n : 0, overflow.data());
+            std::memcpy(overflow.data() + 4, payload->bytes + done, n);
+            std::memset(overflow.data() + 4 + n, 0, n_bytes_per_page - n);
+            uint32_t pg_n = append(overflow.data());
+            if (first_overflow_pg_n == 0) {
+                first_overflow_pg_n = pg_n;
             }
         }
-        new_page.write_header();
-
-        left_child_pointer = compute_database_size_in_pages() + 1;
-        header.database_size_in_pages += 1;
-        write(left_child_pointer, new_page.bytes);
     }
 
-    // need new root
-    uint32_t left_pointer = compute_database_size_in_pages() + 1;
-    uint32_t right_pointer = compute_database_size_in_pages() + 2;
-    header.database_size_in_pages += 2;
-    write(right_pointer, new_page.bytes);
-
-    new_page.recreate(BTreePageType::InteriorTableBTreePage);
-    new_page.header.right_most_pointer = right_most_pointer;
-    for (uint16_t i = 0; i < split_idx; ++i) {
-        if (i < idx) {
-            cell_content_offset = current_page.get_cell_content_offset(i);
-            new_page.insert_interior_cell(i, current_page.get_cell_rowid(cell_content_offset), current_page.get_cell_left_child_pointer(cell_content_offset));
-        } else if (i == idx) {
-            new_page.insert_interior_cell(i, id, left_child_pointer);
-        } else {
-            cell_content_offset = current_page.get_cell_content_offset(i - 1);
-            new_page.insert_interior_cell(i, current_page.get_cell_rowid(cell_content_offset), current_page.get_cell_left_child_pointer(cell_content_offset));
-        }
+    leaf.header.start_of_cell_content_area -= cell_size;
+    uint32_t offset = leaf.header.start_of_cell_content_area;
+    ++leaf.header.num_of_cells;
+    leaf.write_cell_content_offset(leaf.header.num_of_cells - 1, offset);
+    offset += write_varint(payload->P, leaf.bytes + offset);
+    offset += write_varint(rowid, leaf.bytes + offset);
+    std::memcpy(leaf.bytes + offset, payload->bytes, local);
+    offset += local;
+    if (first_overflow_pg_n != 0) {
+        write_big_endian32(first_overflow_pg_n, leaf.bytes + offset);
     }
-    new_page.write_header();
-
-    write(left_pointer, new_page.bytes);
-
-    current_page.recreate(BTreePageType::InteriorTableBTreePage);
-    current_page.header.num_of_cells = 1;
-    current_page.header.start_of_cell_content_area -= current_page.compute_cell_size(split_rowid);
-    current_page.header.right_most_pointer = right_pointer;
-    current_page.write_header();
-    uint16_t offset = current_page.header.start_of_cell_content_area;
-    write_big_endian16(offset, current_page.bytes + current_page.get_header_size());
-    offset += write_big_endian32(left_pointer, current_page.bytes + offset);
-    offset += write_varint(split_rowid, current_page.bytes + offset);
-    write(current_pg_n, current_page.bytes);
-
-    return ReturnCodes::CellInserted;
+    last_rowid = rowid;
+    ++n_rows;
+    return !failed;
 }
 
-ReturnCodes DB::find(uint32_t root_pg_n, uint64_t id, Payload* p) {
-    uint32_t current_pg_n = root_pg_n;
-    BTreePage current_page(this, current_pg_n);
-
-    while (current_page.header.page_type != BTreePageType::LeafTableBTreePage) {
-        uint16_t idx = current_page.lower_bound(id);
+void BulkLoader::close_leaf() {
+    BTreePage& leaf = levels[0]->page;
+    leaf.write_header();
+    uint32_t pg_n = append(leaf.bytes);
+    ++levels[0]->n_closed;
+    reset(leaf);
+    add_child(1, pg_n, last_rowid);
+}
 
-        if (idx != current_page.header.num_of_cells) {
-            uint16_t cell_content_offset = current_page.get_cell_content_offset(idx);
-            uint32_t left_child_pointer = current_page.get_cell_left_child_pointer(cell_content_offset);
-            current_pg_n = left_child_pointer;
+// the previous pending child becomes a cell, the new one waits for the next child or for the page to close
+void BulkLoader::add_child(size_t level, uint32_t pg_n, uint64_t rowid) {
+    if (level == levels.size()) {
+        levels.push_back(std::make_unique<Level>(db, BTreePageType::InteriorTableBTreePage));
+        reset(levels[level]->page);
+    }
+    Level& l = *levels[level];
+    if (l.pending_pg_n != 0) {
+        if (!fits(l.page, l.page.compute_cell_size(l.pending_rowid))) {
+            close_interior(level);
         } else {
-            current_pg_n = current_page.get_right_most_pointer();
+            l.page.insert_interior_cell(l.pending_rowid, l.page.header.num_of_cells, l.pending_pg_n);
+            if (l.has_held) {
+                write_held(level);
+            }
         }
-
-        current_page.recreate(current_pg_n);
-    }
-
-    uint16_t idx = current_page.lower_bound(id);
-
-    if (idx == current_page.header.num_of_cells) {
-        return ReturnCodes::CellNotFound;
     }
+    l.pending_pg_n = pg_n;
+    l.pending_rowid = rowid;
+}
 
-    uint16_t cell_content_offset = current_page.get_cell_content_offset(idx);
-    uint64_t rowid = current_page.get_cell_rowid(cell_content_offset);
+// the page waits in held until the next one on the level gets a cell
+void BulkLoader::close_interior(size_t level) {
+    Level& l = *levels[level];
+    l.page.header.right_most_pointer = l.pending_pg_n;
+    l.page.write_header();
+    std::memcpy(l.held.bytes, l.page.bytes, db->get_page_size());
+    l.held.header = l.page.header;
+    l.has_held = true;
+    l.held_rowid = l.pending_rowid;
+    ++l.n_closed;
+    l.pending_pg_n = 0;
+    reset(l.page);
+}
 
-    if (rowid != id) {
-        return ReturnCodes::CellNotFound;
-    }
-    
-    current_page.read_cell(cell_content_offset, p);
-    return ReturnCodes::CellFound;
+void BulkLoader::write_held(size_t level) {
+    Level& l = *levels[level];
+    uint32_t pg_n = append(l.held.bytes);
+    l.has_held = false;
+    add_child(level + 1, pg_n, l.held_rowid);
 }
 
-void DB::print_tree(uint32_t root_pg_n) {
-    if (header.database_size_in_pages <= 1) {
+// at the end the page after held has no cell, only its right-most pointer: held hands it its last child,
+// a held page with a single cell takes that right-most pointer in instead and becomes the last page itself
+void BulkLoader::settle_held(size_t level) {
+    Level& l = *levels[level];
+    BTreePage& held = l.held;
+    uint16_t last = held.header.num_of_cells - 1;
+    if (last == 0) {
+        held.insert_interior_cell(l.held_rowid, 1, held.get_right_most_pointer());
+        held.header.right_most_pointer = l.page.get_right_most_pointer();
+        held.write_header();
+        std::memcpy(l.page.bytes, held.bytes, db->get_page_size());
+        l.page.header = held.header;
+        l.has_held = false;
         return;
     }
+    uint16_t cell_content_offset = held.get_cell_content_offset(last);
+    uint32_t child_pg_n = held.get_cell_left_child_pointer(cell_content_offset);
+    uint64_t rowid = held.get_cell_rowid(cell_content_offset);
+    l.page.insert_interior_cell(l.held_rowid, 0, held.get_right_most_pointer());
+    held.drop_cell(last);
+    held.header.right_most_pointer = child_pg_n;
+    held.write_header();
+    l.held_rowid = rowid;
+    write_held(level);
+}
 
-    BTreePage root(this, root_pg_n);
-    if (root.header.page_type != BTreePageType::InteriorTableBTreePage) {
-        root.print();
-        return;
+// closes every level up to the one with a single page left, that page becomes the root
+bool BulkLoader::finish() {
+    if (failed || finished) {
+        return false;
     }
-
-    uint16_t offset = root.get_header_size();
-    root.print_header();
-    uint64_t rowid;
-    uint32_t left_child_pointer;
-    uint16_t cell_content_offset;
-    for (int i = 0; i < root.header.num_of_cells; ++i) {
-        read_big_endian16(&cell_content_offset, root.bytes + offset + 2 * i);
-        read_big_endian32(&left_child_pointer, root.bytes + cell_content_offset);
-        std::cout << "\t\t/ [" << left_child_pointer << "]\t";
-
-        BTreePage leaf(this, left_child_pointer);
-        leaf.print_cell_offsets_array();
-
-        std::cout << "\n";
-
-        read_varint(&rowid, root.bytes + cell_content_offset + 4);
-        std::cout << "[" << rowid << "]\n";
+    BTreePage* top = &levels[0]->page;
+    if (levels[0]->n_closed != 0) {
+        close_leaf();
+        for (size_t level = 1;; ++level) {
+            Level& l = *levels[level];
+            l.page.header.right_most_pointer = l.pending_pg_n;
+            l.page.write_header();
+            if (l.has_held) {
+                settle_held(level);
+            }
+            if (level + 1 == levels.size()) {
+                top = &l.page;
+                break;
+            }
+            add_child(level + 1, append(l.page.bytes), l.pending_rowid);
+        }
     }
-
-    std::cout << "\t\t\\ [" << root.get_right_most_pointer() << "]\t";
-    BTreePage leaf(this, root.get_right_most_pointer());
-    leaf.print_cell_offsets_array();
-    std::cout << "\n";
+    top->write_header();
+    bool ok = flush() && (db->synchronous == Synchronous::Off || db->file->sync()); // the pages before the root pointing at them
+    if (!ok) {
+        std::cerr << "bulk load failed\n";
+        failed = true;
+        return false;
+    }
+    db->write(root_pg_n, top->bytes);
+    db->rightmost_leaves.erase(root_pg_n);
+    finished = true;
+    return own_transaction ? db->commit() : true;
 }
 
 void DB::print_schema_format_description(int format) {
@@ -1048,15 +3810,15 @@ void DB::print_header() {
 }
 
 
-uint16_t BTreePage::min_payload() {
-    uint16_t U = db->get_U();
-    uint16_t M = ((U - 12) * 32 / 255) - 23;
+uint32_t BTreePage::min_payload() {
+    uint32_t U = db->get_U();
+    uint32_t M = ((U - 12) * 32 / 255) - 23;
     return M;
 }
 
-uint16_t BTreePage::max_payload() {
-    uint16_t U = db->get_U();
-    uint16_t X;
+uint32_t BTreePage::max_payload() {
+    uint32_t U = db->get_U();
+    uint32_t X = 0;
 
     if (header.page_type == BTreePageType::LeafTableBTreePage || header.page_type == BTreePageType::InteriorTableBTreePage) {
         X = U - 35;
@@ -1068,15 +3830,32 @@ uint16_t BTreePage::max_payload() {
     return X;
 }
 
-uint16_t BTreePage::compute_free_space() {
+uint32_t BTreePage::compute_free_space() {
     return header.start_of_cell_content_area - (2 * header.num_of_cells + get_header_size());
 }
 
-uint16_t BTreePage::compute_directly_stored_payload_size(uint64_t P) { // P: payload size in bytes
-    uint16_t U = db->get_U();
-    uint16_t M = min_payload();
-    uint16_t X = max_payload();
-    uint16_t K = M + ((P - M) % (U - 4));
+// the gap plus every freeblock and fragment, what the page would have free once defragmented
+uint32_t BTreePage::compute_unused_space() {
+    uint32_t unused = compute_free_space() + header.num_of_fragmented_free_bytes_in_cell_content;
+    for (uint16_t freeblock = header.first_free_block; freeblock != 0; ) {
+        uint16_t size;
+        read_big_endian16(&size, bytes + freeblock + 2);
+        unused += size;
+        read_big_endian16(&freeblock, bytes + freeblock);
+    }
+    return unused;
+}
+
+// less than a third in use, as in SQLite
+bool BTreePage::is_underfull() {
+    return compute_unused_space() > db->get_U() * 2 / 3;
+}
+
+uint32_t BTreePage::compute_directly_stored_payload_size(uint64_t P) { // P: payload size in bytes
+    uint32_t U = db->get_U();
+    uint32_t M = min_payload();
+    uint32_t X = max_payload();
+    uint32_t K = M + ((P - M) % (U - 4));
 
     if (P <= X) {
         return P;
@@ -1088,9 +3867,8 @@ uint16_t BTreePage::compute_directly_stored_payload_size(uint64_t P) { // P: pay
     return M;
 }
 
-BTreePage::BTreePage(DB* db, uint32_t pg_n): db(db), bytes(new uint8_t[db->get_page_size()]) {
-    db->file.seekg((pg_n - 1) * db->get_page_size(), std::ios::beg);
-    db->file.read(reinterpret_cast<char*>(bytes), db->get_page_size());
+BTreePage::BTreePage(DB* db, uint32_t pg_n): db(db), bytes(db->pool.alloc()) {
+    db->read_page(pg_n, bytes);
 
     uint16_t offset = 0;
     if (pg_n == 1) {
@@ -1102,7 +3880,9 @@ BTreePage::BTreePage(DB* db, uint32_t pg_n): db(db), bytes(new uint8_t[db->get_p
     header.page_type = get_page_type(page_type);
     offset += read_big_endian16(&header.first_free_block, bytes + offset);
     offset += read_big_endian16(&header.num_of_cells, bytes + offset);
-    offset += read_big_endian16(&header.start_of_cell_content_area, bytes + offset);
+    uint16_t start_of_cell_content_area;
+    offset += read_big_endian16(&start_of_cell_content_area, bytes + offset);
+    header.start_of_cell_content_area = start_of_cell_content_area == 0 ? 65536 : start_of_cell_content_area;
     offset += read_big_endian8(&header.num_of_fragmented_free_bytes_in_cell_content, bytes + offset);
     if (header.page_type == BTreePageType::InteriorIndexBTreePage || header.page_type == BTreePageType::InteriorTableBTreePage) {
         read_big_endian32(&header.right_most_pointer, bytes + offset);
@@ -1111,23 +3891,23 @@ BTreePage::BTreePage(DB* db, uint32_t pg_n): db(db), bytes(new uint8_t[db->get_p
     }
 }
 
-BTreePage::BTreePage(DB* db, BTreePageType page_type): db(db), bytes(new uint8_t[db->get_page_size()]) {
+BTreePage::BTreePage(DB* db, BTreePageType page_type): db(db), bytes(db->pool.alloc()) {
     header.page_type = page_type;
     header.first_free_block = 0;
     header.num_of_cells = 0;
     header.start_of_cell_content_area = db->get_U();
+    header.num_of_fragmented_free_bytes_in_cell_content = 0;
     header.right_most_pointer = 0;
 }
 
-BTreePage::BTreePage(DB* db): db(db), bytes(new uint8_t[db->get_page_size()]) { }
+BTreePage::BTreePage(DB* db): db(db), bytes(db->pool.alloc()) { }
 
 void BTreePage::recreate(uint32_t pg_n) {
-    db->file.seekg((pg_n - 1) * db->get_page_size(), std::ios::beg);
-    db->file.read(reinterpret_cast<char*>(bytes), db->get_page_size());
+    db->read_page(pg_n, bytes);
 
     uint16_t offset = 0;
-    if (pg_n == 1) {
-        is_first_page = true;
+    is_first_page = (pg_n == 1);
+    if (is_first_page) {
         offset = 100;
     }
     uint8_t page_type;
@@ -1135,7 +3915,9 @@ void BTreePage::recreate(uint32_t pg_n) {
     header.page_type = get_page_type(page_type);
     offset += read_big_endian16(&header.first_free_block, bytes + offset);
     offset += read_big_endian16(&header.num_of_cells, bytes + offset);
-    offset += read_big_endian16(&header.start_of_cell_content_area, bytes + offset);
+    uint16_t start_of_cell_content_area;
+    offset += read_big_endian16(&start_of_cell_content_area, bytes + offset);
+    header.start_of_cell_content_area = start_of_cell_content_area == 0 ? 65536 : start_of_cell_content_area;
     offset += read_big_endian8(&header.num_of_fragmented_free_bytes_in_cell_content, bytes + offset);
     if (header.page_type == BTreePageType::InteriorIndexBTreePage || header.page_type == BTreePageType::InteriorTableBTreePage) {
         read_big_endian32(&header.right_most_pointer, bytes + offset);
@@ -1154,7 +3936,7 @@ void BTreePage::recreate(BTreePageType page_type) {
 }
 
 BTreePage::~BTreePage() {
-    delete[] bytes;
+    db->pool.free(bytes);
 }
 
 void BTreePage::write_header() {
@@ -1166,7 +3948,7 @@ void BTreePage::write_header() {
     offset += write_big_endian8(page_type, bytes + offset);
     offset += write_big_endian16(header.first_free_block, bytes + offset);
     offset += write_big_endian16(header.num_of_cells, bytes + offset);
-    offset += write_big_endian16(header.start_of_cell_content_area, bytes + offset);
+    offset += write_big_endian16(static_cast<uint16_t>(header.start_of_cell_content_area), bytes + offset); // 65536 wraps to 0
     offset += write_big_endian8(header.num_of_fragmented_free_bytes_in_cell_content, bytes + offset);
     if (header.page_type == BTreePageType::InteriorIndexBTreePage || header.page_type == BTreePageType::InteriorTableBTreePage) {
         offset += write_big_endian32(header.right_most_pointer, bytes + offset);
@@ -1226,8 +4008,6 @@ uint32_t BTreePage::get_cell_left_child_pointer(uint16_t offset) { // 0 means so
     uint32_t left_child_pointer;
     switch (header.page_type) {
         case BTreePageType::InteriorIndexBTreePage:
-            return 0;
-            break;
         case BTreePageType::InteriorTableBTreePage:
             offset += read_big_endian32(&left_child_pointer, bytes + offset);
             return left_child_pointer;
@@ -1293,6 +4073,20 @@ uint64_t BTreePage::get_cell_payload_size(uint16_t offset) {
     }
 }
 
+uint32_t BTreePage::get_cell_size(uint16_t offset) {
+    uint64_t rowid = 0, num_payload_bytes = 0;
+    if (header.page_type == BTreePageType::InteriorTableBTreePage || header.page_type == BTreePageType::InteriorIndexBTreePage) {
+        offset += 4;
+    }
+    if (header.page_type != BTreePageType::InteriorTableBTreePage) {
+        offset += read_varint(&num_payload_bytes, bytes + offset);
+    }
+    if (header.page_type == BTreePageType::InteriorTableBTreePage || header.page_type == BTreePageType::LeafTableBTreePage) {
+        read_varint(&rowid, bytes + offset);
+    }
+    return compute_cell_size(rowid, num_payload_bytes);
+}
+
 void BTreePage::shift_cell_offsets_array(uint16_t idx) {
     for (int i = header.num_of_cells - 1; i > idx; --i) {
         uint16_t cell_content_offset = get_cell_content_offset(i - 1);
@@ -1322,14 +4116,14 @@ uint16_t BTreePage::lower_bound(uint64_t id) {
     return left;
 }
 
-uint16_t BTreePage::compute_cell_size(uint64_t id, uint64_t P) {
-    uint16_t cell_size = 0;
+uint32_t BTreePage::compute_cell_size(uint64_t id, uint64_t P) {
+    uint32_t cell_size = 0;
     if (header.page_type == BTreePageType::InteriorTableBTreePage || header.page_type == BTreePageType::InteriorIndexBTreePage) {
         cell_size += 4;
     }
     if (header.page_type == BTreePageType::LeafTableBTreePage || header.page_type == BTreePageType::LeafIndexBTreePage || header.page_type == BTreePageType::InteriorIndexBTreePage) {
         cell_size += get_n_bytes_in_varint(P);
-        uint16_t directly_stored_payload = compute_directly_stored_payload_size(P);
+        uint32_t directly_stored_payload = compute_directly_stored_payload_size(P);
         cell_size += directly_stored_payload;
         if (directly_stored_payload < P) {
             cell_size += 4;
@@ -1342,14 +4136,12 @@ uint16_t BTreePage::compute_cell_size(uint64_t id, uint64_t P) {
 }
 
 ReturnCodes BTreePage::insert_interior_cell(uint64_t id, uint16_t cell_offsets_idx, uint32_t left_child_pointer) {
-    uint16_t cell_size = compute_cell_size(id);
+    uint32_t cell_size = compute_cell_size(id);
 
-    if (cell_size > compute_free_space()) {
+    uint32_t offset = allocate_space(cell_size);
+    if (offset == 0) {
         return ReturnCodes::NotEnoughSpaceToInsert;
     }
-
-    header.start_of_cell_content_area -= cell_size;
-    uint16_t offset = header.start_of_cell_content_area;
     header.num_of_cells++;
 
     shift_cell_offsets_array(cell_offsets_idx);
@@ -1363,16 +4155,14 @@ ReturnCodes BTreePage::insert_interior_cell(uint64_t id, uint16_t cell_offsets_i
 }
 
 ReturnCodes BTreePage::insert_leaf_cell(uint64_t id, uint16_t cell_offsets_idx, Payload* payload = nullptr) {
-    uint16_t directly_stored_payload = compute_directly_stored_payload_size(payload->P);
+    uint32_t directly_stored_payload = compute_directly_stored_payload_size(payload->P);
     uint32_t first_overflow_page;
-    uint16_t cell_size = compute_cell_size(id, payload->P);
+    uint32_t cell_size = compute_cell_size(id, payload->P);
 
-    if (cell_size > compute_free_space()) {
+    uint32_t offset = allocate_space(cell_size);
+    if (offset == 0) {
         return ReturnCodes::NotEnoughSpaceToInsert;
     }
-
-    header.start_of_cell_content_area -= cell_size;
-    uint16_t offset = header.start_of_cell_content_area;
     header.num_of_cells++;
 
     shift_cell_offsets_array(cell_offsets_idx);
@@ -1386,19 +4176,16 @@ ReturnCodes BTreePage::insert_leaf_cell(uint64_t id, uint16_t cell_offsets_idx,
     offset += directly_stored_payload;
 
     if (directly_stored_payload < payload->P) {
-        first_overflow_page = db->compute_database_size_in_pages() + 1;
-        offset += write_big_endian32(first_overflow_page, bytes + offset);
-    }
-
-    if (directly_stored_payload < payload->P) {
-        uint8_t* overflow_bytes = new uint8_t[db->get_page_size()];
-
         uint32_t n_overflow_pages = (payload->P - directly_stored_payload) / (db->get_U() - 4);
         if (((payload->P - directly_stored_payload) % (db->get_U() - 4)) != 0) {
             n_overflow_pages += 1;
         }
 
-        db->header.database_size_in_pages += n_overflow_pages;
+        // one extent, so the chain can be read back with a single read
+        first_overflow_page = db->allocate_pages(n_overflow_pages);
+        offset += write_big_endian32(first_overflow_page, bytes + offset);
+
+        uint8_t* overflow_bytes = db->pool.alloc();
 
         for (uint32_t ovflw_pg_n = first_overflow_page; ovflw_pg_n < first_overflow_page + n_overflow_pages - 1; ++ovflw_pg_n) {
             std::memcpy(overflow_bytes + 4, payload->bytes + directly_stored_payload + (db->get_U() - 4) * (ovflw_pg_n - first_overflow_page), db->get_U() - 4);
@@ -1406,62 +4193,154 @@ ReturnCodes BTreePage::insert_leaf_cell(uint64_t id, uint16_t cell_offsets_idx,
             db->write(ovflw_pg_n, overflow_bytes);
         }
 
-        uint16_t last_ovflw_pg_size = (((payload->P - directly_stored_payload) % (db->get_U() - 4)) == 0) ? (db->get_U() - 4) : ((payload->P - directly_stored_payload) % (db->get_U() - 4));
+        uint32_t last_ovflw_pg_size = (((payload->P - directly_stored_payload) % (db->get_U() - 4)) == 0) ? (db->get_U() - 4) : ((payload->P - directly_stored_payload) % (db->get_U() - 4));
         std::memcpy(overflow_bytes + 4, payload->bytes + directly_stored_payload + (db->get_U() - 4) * (n_overflow_pages - 1), last_ovflw_pg_size);
         write_big_endian32(0, overflow_bytes);
 
         db->write(first_overflow_page + n_overflow_pages - 1, overflow_bytes);
 
-        delete[] overflow_bytes;
+        db->pool.free(overflow_bytes);
     }
     return ReturnCodes::CellInserted;
 }
 
-#define abs(x) ((x) < 0 ? -(x) : (x))
-
-uint16_t BTreePage::get_split_index(uint16_t idx, uint16_t* sums, uint16_t* cell_sizes, uint16_t* cell_content_offsets) {
-    uint16_t s = 0;
-
-    for (uint16_t i = 0; i < header.num_of_cells; ++i) {
-        uint16_t cell_content_offset = get_cell_content_offset(i);
-        uint64_t cell_payload_size = get_cell_payload_size(cell_content_offset);
-        uint64_t cell_rowid = get_cell_rowid(cell_content_offset);
-        uint16_t cell_size = compute_cell_size(cell_rowid, cell_payload_size);
+// takes the cell out of the cell pointer array, its bytes go back through free_space
+void BTreePage::drop_cell(uint16_t idx) {
+    uint16_t cell_content_offset = get_cell_content_offset(idx);
+    uint32_t cell_size = get_cell_size(cell_content_offset);
+    uint8_t* pointer = bytes + get_header_size() + 2 * idx;
+    std::memmove(pointer, pointer + 2, 2 * (header.num_of_cells - idx - 1));
+    header.num_of_cells--;
+    free_space(cell_content_offset, cell_size);
+    write_header();
+}
 
-        if (i == idx) {
-            s += cell_sizes[i];
-            sums[i] = s;
+// [offset, offset + size) of the cell content area is free again: right at the start of the area the area
+// just shrinks, otherwise the bytes join the freeblock list, kept in offset order and merged with neighbours,
+// as in SQLite a fragment of up to 3 bytes between the block and a neighbour is merged in as well,
+// less than 4 bytes with nothing to merge with can't hold a freeblock and count as fragments
+void BTreePage::free_space(uint32_t offset, uint32_t size) {
+    uint32_t end = offset + size;
+    uint16_t prev = 0, next = header.first_free_block;
+    while (next != 0 && next < offset) {
+        prev = next;
+        read_big_endian16(&next, bytes + next);
+    }
+    if (next != 0 && end + 3 >= next) {
+        uint16_t next_size;
+        read_big_endian16(&next_size, bytes + next + 2);
+        header.num_of_fragmented_free_bytes_in_cell_content -= next - end;
+        end = next + next_size;
+        read_big_endian16(&next, bytes + next);
+    }
+    if (prev != 0) {
+        uint16_t prev_size;
+        read_big_endian16(&prev_size, bytes + prev + 2);
+        uint32_t prev_end = prev + prev_size;
+        if (prev_end + 3 >= offset) {
+            header.num_of_fragmented_free_bytes_in_cell_content -= offset - prev_end;
+            offset = prev;
         }
+    }
+    size = end - offset;
+
+    if (offset == header.start_of_cell_content_area) {
+        // nothing lies between the area start and this block, so it is the first one
+        header.first_free_block = next;
+        header.start_of_cell_content_area += size;
+        return;
+    }
+    if (size < 4) {
+        header.num_of_fragmented_free_bytes_in_cell_content += size;
+        return;
+    }
+    if (prev == 0) {
+        header.first_free_block = offset;
+    } else if (prev != offset) {
+        write_big_endian16(offset, bytes + prev);
+    }
+    write_big_endian16(next, bytes + offset);
+    write_big_endian16(size, bytes + offset + 2);
+}
 
-        cell_sizes[i + (i >= idx)] = cell_size;
-        cell_content_offsets[i + (i >= idx)] = cell_content_offset;
-        s += cell_size;
-        sums[i + (i >= idx)] = s;
+// room for a cell of size bytes plus its cell pointer, 0 when the page is really full
+// a freeblock big enough gives up its tail first, less than 4 bytes left over become fragments, then the gap
+// is used, and when only the freeblocks and fragments together leave enough the page is defragmented first
+uint16_t BTreePage::allocate_space(uint32_t size) {
+    if (size + 2 > compute_unused_space()) {
+        return 0;
     }
 
-    if (idx == header.num_of_cells) {
-        s += cell_sizes[idx];
-        sums[idx] = s;
+    if (compute_free_space() >= 2) {
+        uint16_t prev = 0;
+        for (uint16_t freeblock = header.first_free_block; freeblock != 0; ) {
+            uint16_t next, block_size;
+            read_big_endian16(&next, bytes + freeblock);
+            read_big_endian16(&block_size, bytes + freeblock + 2);
+            if (block_size >= size) {
+                uint16_t left = block_size - size;
+                if (left >= 4) {
+                    write_big_endian16(left, bytes + freeblock + 2);
+                    return freeblock + left;
+                }
+                // a well-formed page holds at most 60 bytes of fragments
+                if (header.num_of_fragmented_free_bytes_in_cell_content + left > 60) {
+                    break;
+                }
+                if (prev != 0) {
+                    write_big_endian16(next, bytes + prev);
+                } else {
+                    header.first_free_block = next;
+                }
+                header.num_of_fragmented_free_bytes_in_cell_content += left;
+                return freeblock;
+            }
+            prev = freeblock;
+            freeblock = next;
+        }
     }
 
-    uint16_t split_idx = 0;
-    uint16_t S = sums[header.num_of_cells];
-    uint16_t min_diff = S;
-    for (uint16_t i = 0; i < header.num_of_cells + 1; ++i) {
-        uint16_t diff = abs((S - sums[i]) - sums[i]);
-        if (diff < min_diff) {
-            min_diff = diff;
-            split_idx = i;
+    if (size + 2 > compute_free_space()) {
+        defragment();
+        if (size + 2 > compute_free_space()) { // the header claimed more fragments than there were
+            return 0;
         }
     }
-    return split_idx;
+    header.start_of_cell_content_area -= size;
+    return header.start_of_cell_content_area;
 }
 
+// moves the cells to the end of the page one after another in cell pointer order, freeblocks and fragments
+// all join the gap
+void BTreePage::defragment() {
+    std::vector<uint32_t> cell_sizes(header.num_of_cells);
+    for (uint16_t idx = 0; idx < header.num_of_cells; ++idx) {
+        cell_sizes[idx] = get_cell_size(get_cell_content_offset(idx));
+    }
+
+    uint8_t* copy = db->pool.alloc();
+    std::memcpy(copy, bytes, db->get_page_size());
+    uint32_t top = db->get_U();
+    for (uint16_t idx = 0; idx < header.num_of_cells; ++idx) {
+        uint16_t cell_content_offset = get_cell_content_offset(idx);
+        top -= cell_sizes[idx];
+        std::memcpy(bytes + top, copy + cell_content_offset, cell_sizes[idx]);
+        write_cell_content_offset(idx, top);
+    }
+    db->pool.free(copy);
+
+    uint32_t cell_pointers_end = get_header_size() + 2 * header.num_of_cells;
+    std::memset(bytes + cell_pointers_end, 0, top - cell_pointers_end);
+    header.first_free_block = 0;
+    header.num_of_fragmented_free_bytes_in_cell_content = 0;
+    header.start_of_cell_content_area = top;
+    write_header();
+}
 
 // ----------------------- PRINTS ------------------------
 
 void BTreePage::read_cell(uint16_t offset, Payload* p) {
-    uint64_t num_payload_bytes, num_payload_bytes_in_page, rowid, bytes_to_read;
+    uint64_t num_payload_bytes, num_payload_bytes_in_page, rowid, bytes_to_read, payload_offset;
     uint32_t first_overflow_page;
     switch (header.page_type) {
         case BTreePageType::InteriorIndexBTreePage:
@@ -1484,20 +4363,32 @@ void BTreePage::read_cell(uint16_t offset, Payload* p) {
             }
             offset += read_big_endian32(&first_overflow_page, bytes + offset + num_payload_bytes_in_page);
 
-            uint8_t buffer[4];
-            offset = num_payload_bytes_in_page;
+            payload_offset = num_payload_bytes_in_page;
+
+            // with io_uring the whole chain is read at once instead of page after page
+            if (db->ring.is_open()) {
+                db->prefetch(first_overflow_page, (num_payload_bytes - num_payload_bytes_in_page + db->get_U() - 5) / (db->get_U() - 4));
+            }
 
             while (first_overflow_page != 0) {
-                db->file.seekg((db->get_page_size()) * (first_overflow_page - 1), std::ios::beg);
-                db->file.read(reinterpret_cast<char*>(buffer), 4);
-                read_big_endian32(&first_overflow_page, buffer);                
+                // contiguous runs of the chain go straight into the payload with one read
+                uint32_t n_pages = db->read_overflow_run(first_overflow_page, num_payload_bytes - payload_offset, p->bytes + payload_offset, &first_overflow_page);
+                if (n_pages != 0) {
+                    payload_offset = std::min<uint64_t>(num_payload_bytes, payload_offset + static_cast<uint64_t>(n_pages) * (db->get_U() - 4));
+                    continue;
+                }
+                uint32_t ovflw_pg_n = first_overflow_page;
+                bool mapped;
+                const uint8_t* overflow_bytes = db->pin_page(ovflw_pg_n, &mapped);
+                read_big_endian32(&first_overflow_page, overflow_bytes);
                 if (first_overflow_page == 0 && ((num_payload_bytes - num_payload_bytes_in_page) % (db->get_U() - 4)) != 0) {
                     bytes_to_read = (num_payload_bytes - num_payload_bytes_in_page) % (db->get_U() - 4);
                 } else {
                     bytes_to_read = db->get_U() - 4;
                 }
-                db->file.read(reinterpret_cast<char*>(p->bytes + offset), bytes_to_read);
-                offset += bytes_to_read;
+                std::memcpy(p->bytes + payload_offset, overflow_bytes + 4, bytes_to_read);
+                db->unpin_page(ovflw_pg_n, mapped);
+                payload_offset += bytes_to_read;
             }
             return;
         case BTreePageType::Invalid:
@@ -1506,6 +4397,70 @@ void BTreePage::read_cell(uint16_t offset, Payload* p) {
     return;
 }
 
+// no copy unless the payload spills onto overflow pages
+void BTreePage::read_cell(uint16_t offset, PayloadView* v) {
+    if (header.page_type != BTreePageType::LeafTableBTreePage) {
+        return;
+    }
+    uint64_t num_payload_bytes, rowid;
+    uint16_t cell_content_offset = offset;
+    offset += read_varint(&num_payload_bytes, bytes + offset);
+    offset += read_varint(&rowid, bytes + offset);
+    if (num_payload_bytes != compute_directly_stored_payload_size(num_payload_bytes)) {
+        read_cell(cell_content_offset, &v->overflow);
+        v->P = v->overflow.P;
+        v->bytes = v->overflow.bytes;
+        v->rowid = v->overflow.rowid;
+        return;
+    }
+    v->P = num_payload_bytes;
+    v->bytes = bytes + offset;
+    v->rowid = rowid;
+}
+
+void BTreePage::prefetch_children() {
+    if (header.page_type != BTreePageType::InteriorTableBTreePage) {
+        return;
+    }
+    std::vector<uint32_t> children;
+    children.reserve(header.num_of_cells + 1);
+    for (uint16_t idx = 0; idx < header.num_of_cells; ++idx) {
+        children.push_back(get_cell_left_child_pointer(get_cell_content_offset(idx)));
+    }
+    children.push_back(get_right_most_pointer());
+    db->prefetch_pages(children);
+}
+
+// overflow chains are allocated as contiguous runs by insert_leaf_cell, so each chain is one range
+void BTreePage::prefetch_overflow() {
+    if (header.page_type != BTreePageType::LeafTableBTreePage) {
+        return;
+    }
+    uint32_t run_start = 0, run_length = 0;
+    for (uint16_t idx = 0; idx < header.num_of_cells; ++idx) {
+        uint16_t cell_content_offset = get_cell_content_offset(idx);
+        uint64_t num_payload_bytes = get_cell_payload_size(cell_content_offset);
+        uint64_t num_payload_bytes_in_page = compute_directly_stored_payload_size(num_payload_bytes);
+        if (num_payload_bytes == num_payload_bytes_in_page) {
+            continue;
+        }
+        uint32_t first_overflow_page = get_cell_first_overflow_page(cell_content_offset);
+        uint32_t n_overflow_pages = (num_payload_bytes - num_payload_bytes_in_page + db->get_U() - 5) / (db->get_U() - 4);
+        if (run_length != 0 && first_overflow_page == run_start + run_length) {
+            run_length += n_overflow_pages;
+            continue;
+        }
+        if (run_length != 0) {
+            db->prefetch(run_start, run_length);
+        }
+        run_start = first_overflow_page;
+        run_length = n_overflow_pages;
+    }
+    if (run_length != 0) {
+        db->prefetch(run_start, run_length);
+    }
+}
+
 void BTreePage::print_cell(uint16_t offset) {
     uint64_t num_payload_bytes, num_payload_bytes_in_page;
     switch (header.page_type) {
@@ -1707,25 +4662,43 @@ void Payload::recreate(uint64_t P, uint64_t rowid) {
 }
 
 int64_t Payload::get_integer_column(uint16_t column_idx) {
-    uint64_t bytes_in_header, serial_type_code, content_size;
+    return PayloadView(*this).get_integer_column(column_idx);
+}
+
+std::string Payload::get_text_column(uint16_t column_idx) {
+    return std::string(PayloadView(*this).get_text_column(column_idx));
+}
+
+void Payload::print() {
+    PayloadView(*this).print();
+}
+
+// locates column content by walking the record header, false if there is no such column
+bool PayloadView::find_column(uint16_t column_idx, uint64_t* content_offset, uint64_t* content_size) {
+    uint64_t bytes_in_header, serial_type_code;
     int n_columns = 0;
     uint64_t offset = 0;
     offset += read_varint(&bytes_in_header, bytes + offset);
 
-    uint64_t target_content_offset = bytes_in_header;
+    *content_offset = bytes_in_header;
 
     while (offset < bytes_in_header) {
         offset += read_varint(&serial_type_code, bytes + offset);
         ++n_columns;
         if (n_columns == column_idx) {
-            content_size = get_column_content_size(serial_type_code);
-            break;
+            *content_size = Payload::get_column_content_size(serial_type_code);
+            return true;
         }
-        target_content_offset += get_column_content_size(serial_type_code);
+        *content_offset += Payload::get_column_content_size(serial_type_code);
     }
 
-    if (n_columns != column_idx) {
-        std::cout << "no column with index " << column_idx << "\n";
+    std::cout << "no column with index " << column_idx << "\n";
+    return false;
+}
+
+int64_t PayloadView::get_integer_column(uint16_t column_idx) {
+    uint64_t target_content_offset, content_size;
+    if (!find_column(column_idx, &target_content_offset, &content_size)) {
         return 0;
     }
 
@@ -1743,32 +4716,15 @@ int64_t Payload::get_integer_column(uint16_t column_idx) {
     }
 }
 
-std::string Payload::get_text_column(uint16_t column_idx) {
-    uint64_t bytes_in_header, serial_type_code, content_size;
-    int n_columns = 0;
-    uint64_t offset = 0;
-    offset += read_varint(&bytes_in_header, bytes + offset);
-
-    uint64_t target_content_offset = bytes_in_header;
-
-    while (offset < bytes_in_header) {
-        offset += read_varint(&serial_type_code, bytes + offset);
-        ++n_columns;
-        if (n_columns == column_idx) {
-            content_size = get_column_content_size(serial_type_code);
-            break;
-        }
-        target_content_offset += get_column_content_size(serial_type_code);
-    }
-
-    if (n_columns != column_idx) {
-        std::cout << "no column with index " << column_idx << "\n";
-        return std::string();
+std::string_view PayloadView::get_text_column(uint16_t column_idx) {
+    uint64_t target_content_offset, content_size;
+    if (!find_column(column_idx, &target_content_offset, &content_size)) {
+        return std::string_view();
     }
-    return std::string(reinterpret_cast<char*>(bytes + target_content_offset), content_size);
+    return std::string_view(reinterpret_cast<const char*>(bytes + target_content_offset), content_size);
 }
 
-void Payload::print() {
+void PayloadView::print() {
     std::cout << "\n--- Payload Description ---\n\n";
     uint64_t bytes_in_header, serial_type_code, content_size; // including varint size itself
 
@@ -1785,7 +4741,7 @@ void Payload::print() {
         offset += read_varint(&serial_type_code, bytes + offset);
         std::cout << "serial_type_code: " << serial_type_code << "\n";
         ++n_columns;
-        content_size = print_serial_type_description(serial_type_code);
+        content_size = Payload::print_serial_type_description(serial_type_code);
         content_sizes.push_back(content_size);
         std::cout << "\n";
     }
@@ -2005,7 +4961,7 @@ bool Parser::parse_values(Payload* p) {
     return true;
 }
 
-bool Parser::parse_where(Payload* p) {
+bool Parser::parse_where(PayloadView* p) {
     this->p = p;
     return parse_or();
 }
@@ -2031,7 +4987,6 @@ bool Parser::parse_and() {
 }
 
 bool Parser::parse_comparison() {
-    std::string column;
     if (match(Tag::LEFT_BRACKET)) {
         bool res = parse_or();
         if (!match(Tag::RIGHT_BRACKET)) {
@@ -2045,7 +5000,7 @@ bool Parser::parse_comparison() {
         return false;
     }
 
-    column = static_cast<StringLiteral*>(lex.cur)->value;
+    const std::string& column = static_cast<StringLiteral*>(lex.cur)->value;
 
     //std::cout << column << "\n";
 
@@ -2084,4 +5039,63 @@ bool Parser::parse_comparison() {
     lex.scan();
 
     return compare(t, v1, v2);
+}
+
+// id OP integer [AND id OP integer]... and nothing else narrows [low, high], low > high when nothing is left
+// anything else is false and left to parse_where row by row
+bool Parser::parse_rowid_range(uint64_t* low, uint64_t* high) {
+    auto& table = db->tables[table_name];
+    if (table.columns.count("id") == 0 || table.columns_affinity[table.columns["id"]] != ColumnAffinity::INTEGER) {
+        return false;
+    }
+
+    for (;;) {
+        if (lex.cur->tag != Tag::STRING_LITERAL || static_cast<StringLiteral*>(lex.cur)->value != "id") {
+            return false;
+        }
+        Tag t = lex.scan()->tag;
+        if (lex.scan()->tag != Tag::INTEGER_LITERAL) {
+            return false;
+        }
+        uint64_t v = static_cast<IntegerLiteral*>(lex.cur)->value;
+        lex.scan();
+
+        switch (t) {
+            case Tag::EQUAL:
+                *low = std::max(*low, v);
+                *high = std::min(*high, v);
+                break;
+            case Tag::GREATER_OR_EQUAL:
+                *low = std::max(*low, v);
+                break;
+            case Tag::LESS_OR_EQUAL:
+                *high = std::min(*high, v);
+                break;
+            case Tag::GREATER:
+                if (v == UINT64_MAX) {
+                    *low = 1;
+                    *high = 0;
+                } else {
+                    *low = std::max(*low, v + 1);
+                }
+                break;
+            case Tag::LESS:
+                if (v == 0) {
+                    *low = 1;
+                    *high = 0;
+                } else {
+                    *high = std::min(*high, v - 1);
+                }
+                break;
+            default:
+                return false;
+        }
+
+        if (lex.cur->tag == Tag::EOF_TOKEN) {
+            return true;
+        }
+        if (!match(Tag::AND)) {
+            return false;
+        }
+    }
 }
\ No newline at end of file
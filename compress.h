@@ -0,0 +1,144 @@
+#include <cstdint>
+#include <cstring>
+
+// Byte-oriented LZ77 in the LZ4 block format: a token byte with the literal count in the high nibble
+// and the match length - 4 in the low one, 15 in a nibble means more length bytes follow (255 = keep adding),
+// then the literals, then a 2-byte little-endian match offset
+// Fast enough to sit under every page read, JSON rows shrink to a third or less
+
+static const uint32_t LZ_MIN_MATCH = 4;
+static const uint32_t LZ_HASH_BITS = 12;
+
+static uint32_t lz_hash(const uint8_t* p) {
+    uint32_t v;
+    std::memcpy(&v, p, 4);
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+static uint8_t* lz_write_length(uint8_t* out, const uint8_t* out_end, size_t length) {
+    while (length >= 255) {
+        if (out == out_end) {
+            return nullptr;
+        }
+        *out++ = 255;
+        length -= 255;
+    }
+    if (out == out_end) {
+        return nullptr;
+    }
+    *out++ = static_cast<uint8_t>(length);
+    return out;
+}
+
+// 0 when the result doesn't fit into capacity bytes, the caller keeps such data uncompressed
+size_t lz_compress(const uint8_t* src, size_t n, uint8_t* dst, size_t capacity) {
+    uint32_t table[1 << LZ_HASH_BITS];
+    std::memset(table, 0xff, sizeof(table));
+    const uint8_t* out_end = dst + capacity;
+    uint8_t* out = dst;
+    size_t anchor = 0, i = 0;
+
+    for (;;) {
+        size_t match_pos = 0, match_length = 0;
+        while (i + LZ_MIN_MATCH <= n) {
+            uint32_t h = lz_hash(src + i);
+            uint32_t candidate = table[h];
+            table[h] = i;
+            if (candidate != UINT32_MAX && i - candidate <= 0xffff && std::memcmp(src + candidate, src + i, LZ_MIN_MATCH) == 0) {
+                match_pos = candidate;
+                match_length = LZ_MIN_MATCH;
+                while (i + match_length < n && src[candidate + match_length] == src[i + match_length]) {
+                    ++match_length;
+                }
+                break;
+            }
+            ++i;
+        }
+        size_t n_literals = (match_length != 0 ? i : n) - anchor;
+
+        if (out == out_end) {
+            return 0;
+        }
+        uint8_t* token = out++;
+        *token = static_cast<uint8_t>(std::min<size_t>(n_literals, 15) << 4);
+        if (n_literals >= 15 && (out = lz_write_length(out, out_end, n_literals - 15)) == nullptr) {
+            return 0;
+        }
+        if (static_cast<size_t>(out_end - out) < n_literals) {
+            return 0;
+        }
+        std::memcpy(out, src + anchor, n_literals);
+        out += n_literals;
+        if (match_length == 0) {
+            return out - dst; // the last sequence has literals only
+        }
+
+        if (out_end - out < 2) {
+            return 0;
+        }
+        uint16_t offset = i - match_pos;
+        *out++ = offset & 0xff;
+        *out++ = offset >> 8;
+        size_t extra = match_length - LZ_MIN_MATCH;
+        *token |= std::min<size_t>(extra, 15);
+        if (extra >= 15 && (out = lz_write_length(out, out_end, extra - 15)) == nullptr) {
+            return 0;
+        }
+        i += match_length;
+        anchor = i;
+    }
+}
+
+static bool lz_read_length(const uint8_t** in, const uint8_t* in_end, size_t* length) {
+    uint8_t b;
+    do {
+        if (*in == in_end) {
+            return false;
+        }
+        b = *(*in)++;
+        *length += b;
+    } while (b == 255);
+    return true;
+}
+
+// false on damaged input or when it doesn't expand to exactly n bytes
+bool lz_decompress(const uint8_t* src, size_t src_n, uint8_t* dst, size_t n) {
+    const uint8_t* in = src;
+    const uint8_t* in_end = src + src_n;
+    size_t out = 0;
+    while (in < in_end) {
+        uint8_t token = *in++;
+        size_t n_literals = token >> 4;
+        if (n_literals == 15 && !lz_read_length(&in, in_end, &n_literals)) {
+            return false;
+        }
+        if (static_cast<size_t>(in_end - in) < n_literals || n - out < n_literals) {
+            return false;
+        }
+        std::memcpy(dst + out, in, n_literals);
+        in += n_literals;
+        out += n_literals;
+        if (in == in_end) {
+            break;
+        }
+
+        if (in_end - in < 2) {
+            return false;
+        }
+        size_t offset = in[0] | (in[1] << 8);
+        in += 2;
+        size_t match_length = token & 0x0f;
+        if (match_length == 15 && !lz_read_length(&in, in_end, &match_length)) {
+            return false;
+        }
+        match_length += LZ_MIN_MATCH;
+        if (offset == 0 || offset > out || n - out < match_length) {
+            return false;
+        }
+        // byte by byte, a match may overlap the bytes it produces
+        for (size_t k = 0; k < match_length; ++k, ++out) {
+            dst[out] = dst[out - offset];
+        }
+    }
+    return out == n;
+}
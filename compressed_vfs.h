@@ -0,0 +1,484 @@
+#include <map>
+#include <set>
+#include <vector>
+#include <memory>
+#include <shared_mutex>
+
+// Opt-in VFS keeping a database compressed inside a packed container file on another VFS
+// The database file is cut into blocks of block_size bytes (its page size), every block is compressed
+// on its own and stored as an extent anywhere in the container, the map says where the extent of each block is
+// Everything above sees plain pages, reading a page reads only its compressed extent
+//
+// Container layout, numbers are big-endian:
+//   0    magic, block size, logical file size, offset / 16 and number of chunks of the map directory
+//   512  16-byte aligned extents: compressed blocks, map chunks, the directory
+// The map is split into chunks of PACKED_CHUNK_ENTRIES blocks, 8 bytes per block: extent offset / 16 and length,
+// length 0 is a block of zeros without an extent, length == block_size a block stored as is
+// Extents are never overwritten: writes put the new version elsewhere, sync writes the changed map chunks
+// and a new directory before the header switches to them, so a crash leaves the map of the last sync
+// Space of replaced extents is reused after that sync only
+// The log of a database in WAL mode goes to the underlying VFS untouched
+
+static const char PACKED_MAGIC[16] = "packed pages 1";
+static const uint64_t PACKED_DATA_START = 512;
+static const uint32_t PACKED_CHUNK_ENTRIES = 1024;
+
+// free space of the container, best fit
+struct PackedSpace {
+    std::map<uint64_t, uint64_t> holes; // offset -> length
+    std::set<std::pair<uint64_t, uint64_t>> by_length; // (length, offset)
+    uint64_t end = PACKED_DATA_START; // everything from here on is free
+
+    void clear() { holes.clear(); by_length.clear(); end = PACKED_DATA_START; }
+    uint64_t alloc(uint64_t n);
+    void free(uint64_t offset, uint64_t n);
+};
+
+static uint64_t packed_round(uint64_t n) {
+    return (n + 15) / 16 * 16;
+}
+
+uint64_t PackedSpace::alloc(uint64_t n) {
+    n = packed_round(n);
+    auto it = by_length.lower_bound({n, 0});
+    if (it == by_length.end()) {
+        uint64_t offset = end;
+        end += n;
+        return offset;
+    }
+    uint64_t length = it->first, offset = it->second;
+    by_length.erase(it);
+    holes.erase(offset);
+    if (length > n) {
+        holes[offset + n] = length - n;
+        by_length.insert({length - n, offset + n});
+    }
+    return offset;
+}
+
+// merges with the neighbouring holes, a hole reaching the end moves the end instead
+void PackedSpace::free(uint64_t offset, uint64_t n) {
+    n = packed_round(n);
+    auto next = holes.lower_bound(offset);
+    if (next != holes.end() && next->first == offset + n) {
+        n += next->second;
+        by_length.erase({next->second, next->first});
+        next = holes.erase(next);
+    }
+    if (next != holes.begin()) {
+        auto prev = std::prev(next);
+        if (prev->first + prev->second == offset) {
+            offset = prev->first;
+            n += prev->second;
+            by_length.erase({prev->second, prev->first});
+            holes.erase(prev);
+        }
+    }
+    if (offset + n == end) {
+        end = offset;
+        return;
+    }
+    holes[offset] = n;
+    by_length.insert({n, offset});
+}
+
+struct CompressedFile: VfsFile {
+    struct Extent {
+        uint64_t offset;
+        uint32_t length; // 0: zeros, block_size: stored as is
+    };
+
+    std::unique_ptr<VfsFile> base;
+    uint32_t block_size;
+    uint64_t logical_size = 0;
+    std::vector<Extent> blocks;
+    std::vector<uint64_t> chunk_offsets; // where the durable map chunks are, 0 when a chunk was never written
+    std::set<uint32_t> dirty_chunks;
+    uint64_t dir_offset = 0;
+    uint32_t dir_n_chunks = 0;
+    bool header_dirty = false;
+    PackedSpace space;
+    std::vector<std::pair<uint64_t, uint64_t>> pending; // replaced since the last sync, still in the durable map
+    std::shared_mutex mutex; // writes are serialized by the database, page reads come from any thread
+
+    CompressedFile(std::unique_ptr<VfsFile> base, uint32_t block_size): base(std::move(base)), block_size(block_size) { }
+    ~CompressedFile() { sync(); }
+
+    bool load();
+    bool read(uint64_t offset, uint8_t* bytes, size_t n) override;
+    bool read(uint64_t offset, iovec* iov, int iov_n) override;
+    bool write(uint64_t offset, const uint8_t* bytes, size_t n) override;
+    uint64_t size() override;
+    bool sync() override;
+    bool truncate(uint64_t size) override;
+    bool lock(LockType type) override { return base->lock(type); }
+    void unlock() override { base->unlock(); }
+    void prefetch(uint64_t offset, uint64_t n) override;
+
+    bool read_block(uint64_t block, uint8_t* bytes);
+    bool store_block(uint64_t block, const uint8_t* bytes);
+    void release(Extent& extent);
+};
+
+struct CompressedVfs: Vfs {
+    Vfs* base;
+    uint32_t block_size; // for containers created empty, load takes the page size of the database
+
+    CompressedVfs(Vfs* base, uint32_t block_size = 4096): base(base), block_size(block_size) { }
+
+    std::unique_ptr<VfsFile> open(const std::string& fn, bool create = false) override;
+    bool exists(const std::string& fn) override { return base->exists(fn); }
+    bool remove(const std::string& fn) override { return base->remove(fn); }
+    bool load(const std::string& fn, const std::string& path);
+};
+
+std::unique_ptr<VfsFile> CompressedVfs::open(const std::string& fn, bool create) {
+    if (fn.size() > 4 && fn.compare(fn.size() - 4, 4, "-wal") == 0) {
+        return base->open(fn, create);
+    }
+    std::unique_ptr<VfsFile> file = base->open(fn, create);
+    if (file == nullptr) {
+        return nullptr;
+    }
+    auto packed = std::make_unique<CompressedFile>(std::move(file), block_size);
+    if (!packed->load()) {
+        std::cerr << fn << " is not a packed container\n";
+        packed->header_dirty = false; // nothing gets written into a foreign file on close
+        return nullptr;
+    }
+    return packed;
+}
+
+// packs a plain database file from disk into a new container fn
+bool CompressedVfs::load(const std::string& fn, const std::string& path) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) {
+        return false;
+    }
+    std::vector<uint8_t> bytes((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    if (base->exists(fn)) {
+        return false;
+    }
+    uint32_t page_size = block_size;
+    if (bytes.size() >= 100) {
+        uint16_t size_field;
+        read_big_endian16(&size_field, bytes.data() + 16);
+        page_size = size_field == 1 ? 65536 : size_field;
+    }
+    std::unique_ptr<VfsFile> file = base->open(fn, true);
+    if (file == nullptr) {
+        return false;
+    }
+    CompressedFile packed(std::move(file), page_size);
+    return packed.load() && packed.write(0, bytes.data(), bytes.size()) && packed.sync();
+}
+
+// an empty file becomes an empty container on the first sync
+bool CompressedFile::load() {
+    uint64_t file_size = base->size();
+    if (file_size == 0) {
+        header_dirty = true;
+        return true;
+    }
+    uint8_t header[PACKED_DATA_START];
+    if (file_size < PACKED_DATA_START || !base->read(0, header, sizeof(header)) || std::memcmp(header, PACKED_MAGIC, 16) != 0) {
+        return false;
+    }
+    uint32_t size_hi, size_lo, dir_offset16;
+    read_big_endian32(&block_size, header + 16);
+    read_big_endian32(&size_hi, header + 20);
+    read_big_endian32(&size_lo, header + 24);
+    read_big_endian32(&dir_offset16, header + 28);
+    read_big_endian32(&dir_n_chunks, header + 32);
+    if (block_size < 512 || block_size > 65536 || (block_size & (block_size - 1)) != 0) {
+        return false;
+    }
+    logical_size = (static_cast<uint64_t>(size_hi) << 32) | size_lo;
+    dir_offset = static_cast<uint64_t>(dir_offset16) * 16;
+
+    std::vector<std::pair<uint64_t, uint64_t>> used;
+    std::vector<uint8_t> dir(4 * dir_n_chunks);
+    if (dir_n_chunks != 0) {
+        base->read(dir_offset, dir.data(), dir.size());
+        used.push_back({dir_offset, dir.size()});
+    }
+    uint64_t n_blocks = (logical_size + block_size - 1) / block_size;
+    blocks.assign(n_blocks, Extent{0, 0});
+    chunk_offsets.assign(dir_n_chunks, 0);
+    std::vector<uint8_t> chunk(8 * PACKED_CHUNK_ENTRIES);
+    for (uint32_t c = 0; c < dir_n_chunks; ++c) {
+        uint32_t chunk_offset16;
+        read_big_endian32(&chunk_offset16, dir.data() + 4 * c);
+        if (chunk_offset16 == 0) {
+            continue;
+        }
+        chunk_offsets[c] = static_cast<uint64_t>(chunk_offset16) * 16;
+        base->read(chunk_offsets[c], chunk.data(), chunk.size());
+        used.push_back({chunk_offsets[c], chunk.size()});
+        for (uint32_t i = 0; i < PACKED_CHUNK_ENTRIES && static_cast<uint64_t>(c) * PACKED_CHUNK_ENTRIES + i < n_blocks; ++i) {
+            uint32_t offset16, length;
+            read_big_endian32(&offset16, chunk.data() + 8 * i);
+            read_big_endian32(&length, chunk.data() + 8 * i + 4);
+            if (length > block_size) {
+                return false;
+            }
+            Extent& extent = blocks[static_cast<uint64_t>(c) * PACKED_CHUNK_ENTRIES + i];
+            extent = {static_cast<uint64_t>(offset16) * 16, length};
+            if (length != 0) {
+                used.push_back({extent.offset, length});
+            }
+        }
+    }
+
+    // whatever the map doesn't reference is free, including extents written after the last sync
+    std::sort(used.begin(), used.end());
+    space.clear();
+    uint64_t end = PACKED_DATA_START;
+    for (auto& extent : used) {
+        if (extent.first > end) {
+            space.holes[end] = extent.first - end;
+            space.by_length.insert({extent.first - end, end});
+        }
+        end = std::max(end, extent.first + packed_round(extent.second));
+    }
+    space.end = end;
+    return true;
+}
+
+// zeros for blocks past the end or never written, false when the extent can't be read back
+bool CompressedFile::read_block(uint64_t block, uint8_t* bytes) {
+    if (block >= blocks.size() || blocks[block].length == 0) {
+        std::memset(bytes, 0, block_size);
+        return true;
+    }
+    const Extent& extent = blocks[block];
+    if (extent.length == block_size) {
+        return base->read(extent.offset, bytes, block_size);
+    }
+    std::vector<uint8_t> packed(extent.length);
+    if (!base->read(extent.offset, packed.data(), packed.size()) || !lz_decompress(packed.data(), packed.size(), bytes, block_size)) {
+        std::memset(bytes, 0, block_size);
+        std::cerr << "damaged block " << block << " in packed container\n";
+        return false;
+    }
+    return true;
+}
+
+bool CompressedFile::read(uint64_t offset, uint8_t* bytes, size_t n) {
+    std::shared_lock<std::shared_mutex> lock(mutex);
+    bool ok = offset + n <= logical_size;
+    std::vector<uint8_t> buffer;
+    while (n != 0) {
+        uint64_t block = offset / block_size;
+        uint32_t in_block = offset % block_size;
+        size_t length = std::min<uint64_t>(n, block_size - in_block);
+        if (length == block_size) {
+            ok = read_block(block, bytes) && ok;
+        } else {
+            buffer.resize(block_size);
+            ok = read_block(block, buffer.data()) && ok;
+            std::memcpy(bytes, buffer.data() + in_block, length);
+        }
+        offset += length;
+        bytes += length;
+        n -= length;
+    }
+    return ok;
+}
+
+bool CompressedFile::read(uint64_t offset, iovec* iov, int iov_n) {
+    bool ok = true;
+    for (int i = 0; i < iov_n; ++i) {
+        ok = read(offset, static_cast<uint8_t*>(iov[i].iov_base), iov[i].iov_len) && ok;
+        offset += iov[i].iov_len;
+    }
+    return ok;
+}
+
+// old extents stay readable until the next sync made the new map durable
+void CompressedFile::release(Extent& extent) {
+    if (extent.length != 0) {
+        pending.push_back({extent.offset, extent.length});
+    }
+    extent = {0, 0};
+}
+
+bool CompressedFile::store_block(uint64_t block, const uint8_t* bytes) {
+    if (block >= blocks.size()) {
+        blocks.resize(block + 1, Extent{0, 0});
+    }
+    dirty_chunks.insert(block / PACKED_CHUNK_ENTRIES);
+    if (std::all_of(bytes, bytes + block_size, [](uint8_t b) { return b == 0; })) {
+        release(blocks[block]);
+        return true;
+    }
+
+    // only worth it when at least a 16-byte slot is saved
+    std::vector<uint8_t> packed(block_size);
+    size_t length = lz_compress(bytes, block_size, packed.data(), block_size - 16);
+    const uint8_t* data = packed.data();
+    if (length == 0) {
+        length = block_size;
+        data = bytes;
+    }
+    uint64_t offset = space.alloc(length);
+    if (!base->write(offset, data, length)) {
+        space.free(offset, length);
+        return false;
+    }
+    release(blocks[block]);
+    blocks[block] = {offset, static_cast<uint32_t>(length)};
+    return true;
+}
+
+bool CompressedFile::write(uint64_t offset, const uint8_t* bytes, size_t n) {
+    std::unique_lock<std::shared_mutex> lock(mutex);
+    bool ok = true;
+    std::vector<uint8_t> buffer;
+    while (n != 0) {
+        uint64_t block = offset / block_size;
+        uint32_t in_block = offset % block_size;
+        size_t length = std::min<uint64_t>(n, block_size - in_block);
+        if (length == block_size) {
+            ok = store_block(block, bytes) && ok;
+        } else {
+            buffer.resize(block_size);
+            read_block(block, buffer.data());
+            std::memcpy(buffer.data() + in_block, bytes, length);
+            ok = store_block(block, buffer.data()) && ok;
+        }
+        offset += length;
+        bytes += length;
+        n -= length;
+    }
+    if (offset > logical_size) {
+        logical_size = offset;
+        header_dirty = true;
+    }
+    return ok;
+}
+
+uint64_t CompressedFile::size() {
+    std::shared_lock<std::shared_mutex> lock(mutex);
+    return logical_size;
+}
+
+bool CompressedFile::truncate(uint64_t size) {
+    std::unique_lock<std::shared_mutex> lock(mutex);
+    uint64_t n_blocks = (size + block_size - 1) / block_size;
+    for (uint64_t block = n_blocks; block < blocks.size(); ++block) {
+        release(blocks[block]);
+    }
+    if (n_blocks < blocks.size()) {
+        blocks.resize(n_blocks);
+        uint32_t n_chunks = (n_blocks + PACKED_CHUNK_ENTRIES - 1) / PACKED_CHUNK_ENTRIES;
+        for (uint32_t c = n_chunks; c < chunk_offsets.size(); ++c) {
+            if (chunk_offsets[c] != 0) {
+                pending.push_back({chunk_offsets[c], 8 * PACKED_CHUNK_ENTRIES});
+            }
+        }
+        chunk_offsets.resize(std::min<size_t>(n_chunks, chunk_offsets.size()));
+        if (n_blocks != 0) {
+            dirty_chunks.insert((n_blocks - 1) / PACKED_CHUNK_ENTRIES);
+        }
+    }
+    bool ok = true;
+    if (size % block_size != 0 && size < logical_size) {
+        std::vector<uint8_t> buffer(block_size);
+        read_block(size / block_size, buffer.data());
+        std::memset(buffer.data() + size % block_size, 0, block_size - size % block_size);
+        ok = store_block(size / block_size, buffer.data());
+    }
+    logical_size = size;
+    header_dirty = true;
+    return ok;
+}
+
+// the blocks of a range are usually close in the container, one hint covers their extents
+void CompressedFile::prefetch(uint64_t offset, uint64_t n) {
+    std::shared_lock<std::shared_mutex> lock(mutex);
+    uint64_t first = offset / block_size;
+    uint64_t last = std::min<uint64_t>((offset + n + block_size - 1) / block_size, blocks.size());
+    uint64_t start = UINT64_MAX, end = 0;
+    for (uint64_t block = first; block < last; ++block) {
+        if (blocks[block].length != 0) {
+            start = std::min(start, blocks[block].offset);
+            end = std::max(end, blocks[block].offset + blocks[block].length);
+        }
+    }
+    if (start < end) {
+        base->prefetch(start, end - start);
+    }
+}
+
+// changed map chunks and the directory go to new extents, the header is written once they are on disk
+bool CompressedFile::sync() {
+    std::unique_lock<std::shared_mutex> lock(mutex);
+    if (dirty_chunks.empty() && !header_dirty) {
+        return base->sync();
+    }
+    uint32_t n_chunks = (blocks.size() + PACKED_CHUNK_ENTRIES - 1) / PACKED_CHUNK_ENTRIES;
+    chunk_offsets.resize(n_chunks, 0);
+    std::vector<std::pair<uint64_t, uint64_t>> replaced;
+    bool ok = true;
+
+    std::vector<uint8_t> chunk(8 * PACKED_CHUNK_ENTRIES);
+    for (uint32_t c : dirty_chunks) {
+        if (c >= n_chunks) {
+            continue;
+        }
+        std::memset(chunk.data(), 0, chunk.size());
+        for (uint32_t i = 0; i < PACKED_CHUNK_ENTRIES && static_cast<uint64_t>(c) * PACKED_CHUNK_ENTRIES + i < blocks.size(); ++i) {
+            const Extent& extent = blocks[static_cast<uint64_t>(c) * PACKED_CHUNK_ENTRIES + i];
+            write_big_endian32(extent.offset / 16, chunk.data() + 8 * i);
+            write_big_endian32(extent.length, chunk.data() + 8 * i + 4);
+        }
+        uint64_t offset = space.alloc(chunk.size());
+        ok = ok && base->write(offset, chunk.data(), chunk.size());
+        if (chunk_offsets[c] != 0) {
+            replaced.push_back({chunk_offsets[c], chunk.size()});
+        }
+        chunk_offsets[c] = offset;
+    }
+
+    uint64_t new_dir_offset = 0;
+    if (n_chunks != 0) {
+        std::vector<uint8_t> dir(4 * n_chunks);
+        for (uint32_t c = 0; c < n_chunks; ++c) {
+            write_big_endian32(chunk_offsets[c] / 16, dir.data() + 4 * c);
+        }
+        new_dir_offset = space.alloc(dir.size());
+        ok = ok && base->write(new_dir_offset, dir.data(), dir.size());
+    }
+    if (dir_n_chunks != 0) {
+        replaced.push_back({dir_offset, 4 * dir_n_chunks});
+    }
+
+    uint8_t header[PACKED_DATA_START] = {};
+    std::memcpy(header, PACKED_MAGIC, 16);
+    write_big_endian32(block_size, header + 16);
+    write_big_endian32(logical_size >> 32, header + 20);
+    write_big_endian32(logical_size & 0xffffffff, header + 24);
+    write_big_endian32(new_dir_offset / 16, header + 28);
+    write_big_endian32(n_chunks, header + 32);
+    ok = ok && base->sync() && base->write(0, header, sizeof(header)) && base->sync();
+    if (!ok) {
+        return false; // the old header still points at the old map, nothing of it was freed
+    }
+
+    dir_offset = new_dir_offset;
+    dir_n_chunks = n_chunks;
+    dirty_chunks.clear();
+    header_dirty = false;
+    for (auto& extent : replaced) {
+        space.free(extent.first, extent.second);
+    }
+    for (auto& extent : pending) {
+        space.free(extent.first, extent.second);
+    }
+    pending.clear();
+    if (base->size() > space.end) {
+        base->truncate(space.end);
+    }
+    return true;
+}
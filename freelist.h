@@ -0,0 +1,108 @@
+#include <map>
+#include <set>
+#include <vector>
+
+// Free pages of the database file kept in memory as extents of consecutive pages
+// On disk they are the SQLite freelist: a chain of trunk pages, each holding the next trunk page number,
+// the number of leaf page numbers that follow and the leaf page numbers themselves
+// Trunk pages are free pages too, DB keeps the chain as read from disk and on commit
+// rewrites only the trunks whose leaves or next trunk changed
+
+struct FreeTrunk {
+    uint32_t pg_n;
+    std::vector<uint32_t> leaves;
+    bool changed = false; // differs from the page on disk
+};
+
+struct FreeList {
+    std::map<uint32_t, uint32_t> extents; // first page -> number of pages
+    std::set<std::pair<uint32_t, uint32_t>> by_length; // (number of pages, first page) of every extent
+    std::vector<FreeTrunk> trunks; // the chain on disk, first trunk first
+    uint32_t n_pages = 0;
+    bool dirty = false; // differs from the chain on disk
+
+    void clear() { extents.clear(); by_length.clear(); trunks.clear(); n_pages = 0; dirty = false; }
+    bool contains(uint32_t pg_n) const;
+    void add(uint32_t pg_n);
+    bool take(uint32_t n, uint32_t* pg_n);
+    std::vector<uint32_t> pages();
+    void insert_extent(uint32_t first, uint32_t length);
+    std::map<uint32_t, uint32_t>::iterator erase_extent(std::map<uint32_t, uint32_t>::iterator it);
+};
+
+void FreeList::insert_extent(uint32_t first, uint32_t length) {
+    extents[first] = length;
+    by_length.emplace(length, first);
+}
+
+std::map<uint32_t, uint32_t>::iterator FreeList::erase_extent(std::map<uint32_t, uint32_t>::iterator it) {
+    by_length.erase({it->second, it->first});
+    return extents.erase(it);
+}
+
+bool FreeList::contains(uint32_t pg_n) const {
+    auto next = extents.upper_bound(pg_n);
+    return next != extents.begin() && pg_n < std::prev(next)->first + std::prev(next)->second;
+}
+
+// merges with the neighbouring extents
+void FreeList::add(uint32_t pg_n) {
+    auto next = extents.upper_bound(pg_n);
+    if (next != extents.begin()) {
+        auto prev = std::prev(next);
+        if (pg_n < prev->first + prev->second) {
+            return; // already free
+        }
+        if (prev->first + prev->second == pg_n) {
+            uint32_t first = prev->first;
+            uint32_t length = prev->second + 1;
+            erase_extent(prev);
+            if (next != extents.end() && next->first == pg_n + 1) {
+                length += next->second;
+                erase_extent(next);
+            }
+            insert_extent(first, length);
+            ++n_pages;
+            dirty = true;
+            return;
+        }
+    }
+    if (next != extents.end() && next->first == pg_n + 1) {
+        uint32_t length = next->second + 1;
+        erase_extent(next);
+        insert_extent(pg_n, length);
+    } else {
+        insert_extent(pg_n, 1);
+    }
+    ++n_pages;
+    dirty = true;
+}
+
+// best fit: the shortest extent long enough, the lowest of equally long ones so the file fills from the front,
+// long runs stay whole for overflow chains, false if no extent is long enough
+bool FreeList::take(uint32_t n, uint32_t* pg_n) {
+    auto fit = by_length.lower_bound({n, 0});
+    if (fit == by_length.end()) {
+        return false;
+    }
+    *pg_n = fit->second;
+    uint32_t rest = fit->first - n;
+    erase_extent(extents.find(*pg_n));
+    if (rest != 0) {
+        insert_extent(*pg_n + n, rest);
+    }
+    n_pages -= n;
+    dirty = true;
+    return true;
+}
+
+std::vector<uint32_t> FreeList::pages() {
+    std::vector<uint32_t> result;
+    result.reserve(n_pages);
+    for (auto& extent : extents) {
+        for (uint32_t i = 0; i < extent.second; ++i) {
+            result.push_back(extent.first + i);
+        }
+    }
+    return result;
+}
@@ -28,6 +28,12 @@ enum class Tag {
     WHERE,
     AND,
     OR,
+    BEGIN,
+    COMMIT,
+    ROLLBACK,
+    TRANSACTION,
+    VACUUM,
+    DELETE,
     LESS,
     LESS_OR_EQUAL,
     GREATER,
@@ -58,7 +64,14 @@ static std::unordered_map<std::string, Tag> TAG_MAP {
     {"FROM", Tag::FROM},
     {"WHERE", Tag::WHERE},
     {"AND", Tag::AND},
-    {"OR", Tag::OR}
+    {"OR", Tag::OR},
+    {"BEGIN", Tag::BEGIN},
+    {"COMMIT", Tag::COMMIT},
+    {"END", Tag::COMMIT},
+    {"ROLLBACK", Tag::ROLLBACK},
+    {"TRANSACTION", Tag::TRANSACTION},
+    {"VACUUM", Tag::VACUUM},
+    {"DELETE", Tag::DELETE}
 };
 
 struct Token {
@@ -126,6 +139,18 @@ std::string tag_to_string(Tag tag) {
             return "AND";
         case Tag::OR:
             return "OR";
+        case Tag::BEGIN:
+            return "BEGIN";
+        case Tag::COMMIT:
+            return "COMMIT";
+        case Tag::ROLLBACK:
+            return "ROLLBACK";
+        case Tag::TRANSACTION:
+            return "TRANSACTION";
+        case Tag::VACUUM:
+            return "VACUUM";
+        case Tag::DELETE:
+            return "DELETE";
         case Tag::LESS:
             return "LESS";
         case Tag::LESS_OR_EQUAL:
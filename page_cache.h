@@ -0,0 +1,312 @@
+#include <list>
+#include <set>
+#include <unordered_map>
+
+// LRU cache of whole database pages
+// A frame is pinned while somebody reads its bytes, pinned frames are never evicted
+// When every frame is pinned the cache grows past its capacity instead of failing
+// Dirty frames hold one extra pin until they are written back or discarded
+// A dirty frame still pinned by a reader when it is discarded turns stale: pins miss it and the page read
+// again takes its place, the old bytes are freed once the page has no pins left
+// Frame bytes come from the page pool of the database
+// Evicted frames may go to a second tier which keeps them compressed within its own byte budget,
+// a miss looks there before the caller reads the file, a hit moves the page back into a frame
+
+struct PageCache {
+    struct Frame {
+        uint32_t pg_n;
+        uint8_t* bytes;
+        uint32_t pin_count;
+        std::list<uint32_t>::iterator lru_it; // valid only while pin_count == 0
+        bool stale = false; // holds discarded dirty contents, never unpinned into the lru
+        std::vector<uint8_t*> retired; // replaced bytes somebody may still read, freed at pin_count 0
+    };
+
+    PagePool* pool;
+    uint32_t page_size;
+    size_t capacity; // in pages
+    std::unordered_map<uint32_t, Frame> frames;
+    std::list<uint32_t> lru; // unpinned frames, least recently used first
+    std::set<uint32_t> dirty; // ordered so write-back goes through the file sequentially
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+
+    struct Compressed {
+        std::vector<uint8_t> bytes; // page_size bytes when the page doesn't compress
+        std::list<uint32_t>::iterator lru_it;
+    };
+    std::unordered_map<uint32_t, Compressed> compressed; // never holds a page which has a frame
+    std::list<uint32_t> compressed_lru;
+    size_t compressed_capacity = 0; // in bytes, 0 turns the tier off
+    size_t compressed_size = 0;
+    std::vector<uint8_t> scratch;
+    uint64_t compressed_hits = 0;
+    uint64_t compressed_misses = 0;
+
+    PageCache(PagePool* pool, uint32_t page_size, size_t capacity): pool(pool), page_size(page_size), capacity(capacity) { }
+    ~PageCache();
+
+    uint8_t* pin(uint32_t pg_n);
+    uint8_t* pin_new(uint32_t pg_n);
+    uint8_t* pin_new(uint32_t pg_n, uint8_t* bytes);
+    void unpin(uint32_t pg_n);
+    void update(uint32_t pg_n, const uint8_t* bytes, uint32_t offset, uint32_t n);
+    void put_dirty(uint32_t pg_n, const uint8_t* bytes);
+    uint8_t* get_dirty(uint32_t pg_n);
+    void mark_clean(uint32_t pg_n);
+    void discard_dirty();
+    void invalidate(uint32_t pg_n);
+    void clear();
+    void resize(size_t capacity);
+    void resize_compressed(size_t capacity);
+    bool evict_one(bool keep = true);
+    void keep_compressed(uint32_t pg_n, const uint8_t* bytes);
+    void drop_compressed(uint32_t pg_n);
+};
+
+// what an entry costs besides its bytes: map node, list node, vector header
+static const size_t COMPRESSED_ENTRY_OVERHEAD = 96;
+
+PageCache::~PageCache() {
+    clear();
+    for (auto& pair : frames) {
+        pool->free(pair.second.bytes);
+        for (uint8_t* bytes : pair.second.retired) {
+            pool->free(bytes);
+        }
+    }
+}
+
+// returns pinned page bytes or nullptr on miss
+uint8_t* PageCache::pin(uint32_t pg_n) {
+    auto it = frames.find(pg_n);
+    if (it != frames.end() && it->second.stale) {
+        ++misses;
+        return nullptr;
+    }
+    if (it == frames.end()) {
+        ++misses;
+        auto packed = compressed.find(pg_n);
+        if (packed == compressed.end()) {
+            compressed_misses += compressed_capacity != 0;
+            return nullptr;
+        }
+        ++compressed_hits;
+        uint8_t* bytes = pool->alloc();
+        const std::vector<uint8_t>& src = packed->second.bytes;
+        if (src.size() == page_size) {
+            std::memcpy(bytes, src.data(), page_size);
+        } else if (!lz_decompress(src.data(), src.size(), bytes, page_size)) {
+            pool->free(bytes);
+            drop_compressed(pg_n);
+            return nullptr;
+        }
+        drop_compressed(pg_n);
+        return pin_new(pg_n, bytes);
+    }
+    ++hits;
+    Frame& frame = it->second;
+    if (frame.pin_count == 0) {
+        lru.erase(frame.lru_it);
+    }
+    ++frame.pin_count;
+    return frame.bytes;
+}
+
+// allocates pinned frame for a page which is not in cache yet, caller fills it
+uint8_t* PageCache::pin_new(uint32_t pg_n) {
+    return pin_new(pg_n, pool->alloc());
+}
+
+// same but takes ownership of already filled bytes (taken from the pool)
+// if the page got cached meanwhile the cached frame wins and bytes are freed
+uint8_t* PageCache::pin_new(uint32_t pg_n, uint8_t* bytes) {
+    auto it = frames.find(pg_n);
+    if (it != frames.end() && it->second.stale) {
+        it->second.retired.push_back(it->second.bytes);
+        it->second.bytes = bytes;
+        it->second.stale = false;
+        ++it->second.pin_count;
+        return bytes;
+    }
+    if (it != frames.end()) {
+        pool->free(bytes);
+        if (it->second.pin_count == 0) {
+            lru.erase(it->second.lru_it);
+        }
+        ++it->second.pin_count;
+        return it->second.bytes;
+    }
+    drop_compressed(pg_n);
+    if (frames.size() >= capacity) {
+        evict_one();
+    }
+    Frame& frame = frames[pg_n];
+    frame.pg_n = pg_n;
+    frame.bytes = bytes;
+    frame.pin_count = 1;
+    return frame.bytes;
+}
+
+void PageCache::unpin(uint32_t pg_n) {
+    auto it = frames.find(pg_n);
+    if (it == frames.end() || it->second.pin_count == 0) {
+        std::cerr << "unpin of not pinned page " << pg_n << "\n";
+        return;
+    }
+    Frame& frame = it->second;
+    --frame.pin_count;
+    if (frame.pin_count == 0) {
+        for (uint8_t* bytes : frame.retired) {
+            pool->free(bytes);
+        }
+        frame.retired.clear();
+        if (frame.stale) {
+            pool->free(frame.bytes);
+            frames.erase(it);
+            return;
+        }
+        frame.lru_it = lru.insert(lru.end(), pg_n);
+    }
+    if (frames.size() > capacity) {
+        evict_one();
+    }
+}
+
+// write-through: keeps cached copy equal to what was written to the file
+void PageCache::update(uint32_t pg_n, const uint8_t* bytes, uint32_t offset, uint32_t n) {
+    drop_compressed(pg_n);
+    auto it = frames.find(pg_n);
+    if (it == frames.end() || it->second.stale) {
+        return;
+    }
+    std::memcpy(it->second.bytes + offset, bytes, n);
+}
+
+// stores new page contents which are not in the file yet
+void PageCache::put_dirty(uint32_t pg_n, const uint8_t* bytes) {
+    drop_compressed(pg_n);
+    auto it = frames.find(pg_n);
+    if (it == frames.end()) {
+        pin_new(pg_n);
+        it = frames.find(pg_n);
+    } else if (dirty.count(pg_n) == 0) {
+        if (it->second.pin_count == 0) {
+            lru.erase(it->second.lru_it);
+        }
+        ++it->second.pin_count;
+        if (it->second.stale) {
+            it->second.retired.push_back(it->second.bytes);
+            it->second.bytes = pool->alloc();
+            it->second.stale = false;
+        }
+    }
+    dirty.insert(pg_n);
+    std::memcpy(it->second.bytes, bytes, page_size);
+}
+
+uint8_t* PageCache::get_dirty(uint32_t pg_n) {
+    return dirty.count(pg_n) == 0 ? nullptr : frames[pg_n].bytes;
+}
+
+// page reached the file, frame stays cached as a clean one
+void PageCache::mark_clean(uint32_t pg_n) {
+    if (dirty.erase(pg_n) != 0) {
+        unpin(pg_n);
+    }
+}
+
+// drops new contents of every dirty page, next read goes to the file again
+void PageCache::discard_dirty() {
+    for (uint32_t pg_n : dirty) {
+        Frame& frame = frames[pg_n];
+        --frame.pin_count;
+        if (frame.pin_count == 0) {
+            pool->free(frame.bytes);
+            for (uint8_t* bytes : frame.retired) {
+                pool->free(bytes);
+            }
+            frames.erase(pg_n);
+        } else {
+            frame.stale = true;
+        }
+    }
+    dirty.clear();
+}
+
+void PageCache::invalidate(uint32_t pg_n) {
+    drop_compressed(pg_n);
+    auto it = frames.find(pg_n);
+    if (it == frames.end() || it->second.pin_count != 0) {
+        return;
+    }
+    lru.erase(it->second.lru_it);
+    pool->free(it->second.bytes);
+    frames.erase(it);
+}
+
+// drops every unpinned frame and the whole second tier
+void PageCache::clear() {
+    while (evict_one(false)) { }
+    compressed.clear();
+    compressed_lru.clear();
+    compressed_size = 0;
+}
+
+void PageCache::resize(size_t capacity) {
+    this->capacity = capacity;
+    while (frames.size() > capacity && evict_one()) { }
+}
+
+void PageCache::resize_compressed(size_t capacity) {
+    compressed_capacity = capacity;
+    while (compressed_size > compressed_capacity) {
+        drop_compressed(compressed_lru.front());
+    }
+}
+
+// unpinned frames are clean, keep moves the evicted page into the second tier
+bool PageCache::evict_one(bool keep) {
+    if (lru.empty()) {
+        return false;
+    }
+    uint32_t pg_n = lru.front();
+    lru.pop_front();
+    auto it = frames.find(pg_n);
+    if (keep && compressed_capacity != 0) {
+        keep_compressed(pg_n, it->second.bytes);
+    }
+    pool->free(it->second.bytes);
+    frames.erase(it);
+    return true;
+}
+
+// least recently evicted pages leave the tier first when it runs out of budget
+void PageCache::keep_compressed(uint32_t pg_n, const uint8_t* bytes) {
+    scratch.resize(page_size);
+    size_t n = lz_compress(bytes, page_size, scratch.data(), page_size - 1);
+    if (n == 0) {
+        n = page_size;
+        std::memcpy(scratch.data(), bytes, page_size);
+    }
+    if (n + COMPRESSED_ENTRY_OVERHEAD > compressed_capacity) {
+        return;
+    }
+    Compressed& entry = compressed[pg_n];
+    entry.bytes.assign(scratch.data(), scratch.data() + n);
+    entry.lru_it = compressed_lru.insert(compressed_lru.end(), pg_n);
+    compressed_size += n + COMPRESSED_ENTRY_OVERHEAD;
+    while (compressed_size > compressed_capacity) {
+        drop_compressed(compressed_lru.front());
+    }
+}
+
+void PageCache::drop_compressed(uint32_t pg_n) {
+    auto it = compressed.find(pg_n);
+    if (it == compressed.end()) {
+        return;
+    }
+    compressed_size -= it->second.bytes.size() + COMPRESSED_ENTRY_OVERHEAD;
+    compressed_lru.erase(it->second.lru_it);
+    compressed.erase(it);
+}
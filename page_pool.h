@@ -0,0 +1,82 @@
+#include <vector>
+#include <mutex>
+#include <new>
+#include <sys/mman.h>
+
+// Page-sized frames carved out of 2 MiB slabs, freed frames go to a free list and are handed out again
+// Slabs are backed by huge pages when the system has them: reserved ones (MAP_HUGETLB) first,
+// then transparent huge pages on a slab-aligned mapping
+// Memory goes back to the OS only when the pool is destroyed, the page cache capacity bounds it
+
+static const size_t PAGE_POOL_SLAB_SIZE = 2 * 1024 * 1024;
+
+struct PagePool {
+    size_t page_size = 0;
+    std::vector<uint8_t*> free_frames;
+    std::vector<uint8_t*> slabs;
+    std::mutex mutex; // frames are taken outside cache_mutex on page cache misses
+
+    ~PagePool();
+
+    uint8_t* alloc();
+    void free(uint8_t* bytes);
+    bool grow();
+};
+
+PagePool::~PagePool() {
+    for (uint8_t* slab : slabs) {
+        munmap(slab, PAGE_POOL_SLAB_SIZE);
+    }
+}
+
+uint8_t* PagePool::alloc() {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (free_frames.empty() && !grow()) {
+        throw std::bad_alloc();
+    }
+    uint8_t* bytes = free_frames.back();
+    free_frames.pop_back();
+    return bytes;
+}
+
+void PagePool::free(uint8_t* bytes) {
+    if (bytes == nullptr) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    free_frames.push_back(bytes);
+}
+
+// caller holds mutex
+bool PagePool::grow() {
+    if (page_size == 0 || page_size > PAGE_POOL_SLAB_SIZE) {
+        return false;
+    }
+    void* addr = MAP_FAILED;
+#ifdef MAP_HUGETLB
+    addr = mmap(nullptr, PAGE_POOL_SLAB_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+    if (addr == MAP_FAILED) {
+        // twice the size so a slab-aligned slab fits inside, the rest is unmapped right away
+        uint8_t* raw = static_cast<uint8_t*>(mmap(nullptr, 2 * PAGE_POOL_SLAB_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+        if (raw == MAP_FAILED) {
+            return false;
+        }
+        uintptr_t start = (reinterpret_cast<uintptr_t>(raw) + PAGE_POOL_SLAB_SIZE - 1) / PAGE_POOL_SLAB_SIZE * PAGE_POOL_SLAB_SIZE;
+        uint8_t* aligned = reinterpret_cast<uint8_t*>(start);
+        if (aligned != raw) {
+            munmap(raw, aligned - raw);
+        }
+        munmap(aligned + PAGE_POOL_SLAB_SIZE, raw + PAGE_POOL_SLAB_SIZE - aligned);
+#ifdef MADV_HUGEPAGE
+        madvise(aligned, PAGE_POOL_SLAB_SIZE, MADV_HUGEPAGE);
+#endif
+        addr = aligned;
+    }
+    uint8_t* slab = static_cast<uint8_t*>(addr);
+    slabs.push_back(slab);
+    for (size_t offset = PAGE_POOL_SLAB_SIZE; offset >= page_size; offset -= page_size) {
+        free_frames.push_back(slab + offset - page_size);
+    }
+    return true;
+}
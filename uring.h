@@ -0,0 +1,194 @@
+// Minimal io_uring submission/completion ring built on the raw syscalls, only reads are used
+// Not thread-safe by itself, callers serialize access
+
+#if defined(__linux__)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#endif
+
+struct Uring {
+    int fd = -1;
+    unsigned entries = 0;
+    unsigned to_submit = 0;
+
+#if defined(__linux__)
+    unsigned* sq_head = nullptr;
+    unsigned* sq_tail = nullptr;
+    unsigned* sq_mask = nullptr;
+    unsigned* sq_array = nullptr;
+    unsigned* cq_head = nullptr;
+    unsigned* cq_tail = nullptr;
+    unsigned* cq_mask = nullptr;
+    io_uring_sqe* sqes = nullptr;
+    io_uring_cqe* cqes = nullptr;
+    void* sq_ptr = nullptr;
+    void* cq_ptr = nullptr;
+    size_t sq_size = 0;
+    size_t cq_size = 0;
+    size_t sqes_size = 0;
+#endif
+
+    ~Uring() { close(); }
+
+    bool init(unsigned depth);
+    void close();
+    bool is_open() { return fd != -1; }
+    bool push_read(int file_fd, uint64_t offset, uint8_t* bytes, uint32_t n, uint64_t user_data);
+    bool submit();
+    void drop_unsubmitted(std::vector<uint64_t>* user_data);
+    bool pop(uint64_t* user_data, int32_t* res, bool wait);
+};
+
+#if defined(__linux__)
+
+bool Uring::init(unsigned depth) {
+    io_uring_params params;
+    std::memset(&params, 0, sizeof(params));
+    fd = syscall(__NR_io_uring_setup, depth, &params);
+    if (fd < 0) {
+        fd = -1;
+        return false;
+    }
+    entries = params.sq_entries;
+
+    sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap) {
+        sq_size = cq_size = std::max(sq_size, cq_size);
+    }
+
+    sq_ptr = mmap(nullptr, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (sq_ptr == MAP_FAILED) {
+        sq_ptr = nullptr;
+        close();
+        return false;
+    }
+    if (single_mmap) {
+        cq_ptr = sq_ptr;
+    } else {
+        cq_ptr = mmap(nullptr, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (cq_ptr == MAP_FAILED) {
+            cq_ptr = nullptr;
+            close();
+            return false;
+        }
+    }
+    sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+    void* sqes_ptr = mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sqes_ptr == MAP_FAILED) {
+        close();
+        return false;
+    }
+    sqes = static_cast<io_uring_sqe*>(sqes_ptr);
+
+    uint8_t* sq = static_cast<uint8_t*>(sq_ptr);
+    sq_head = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+    sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    sq_mask = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    uint8_t* cq = static_cast<uint8_t*>(cq_ptr);
+    cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    cq_mask = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+    return true;
+}
+
+void Uring::close() {
+    if (sqes != nullptr) {
+        munmap(sqes, sqes_size);
+        sqes = nullptr;
+    }
+    if (cq_ptr != nullptr && cq_ptr != sq_ptr) {
+        munmap(cq_ptr, cq_size);
+    }
+    cq_ptr = nullptr;
+    if (sq_ptr != nullptr) {
+        munmap(sq_ptr, sq_size);
+        sq_ptr = nullptr;
+    }
+    if (fd != -1) {
+        ::close(fd);
+        fd = -1;
+    }
+    to_submit = 0;
+}
+
+// queues a read, false when the submission queue is full
+bool Uring::push_read(int file_fd, uint64_t offset, uint8_t* bytes, uint32_t n, uint64_t user_data) {
+    unsigned tail = *sq_tail;
+    unsigned head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+    if (tail - head >= entries) {
+        return false;
+    }
+    unsigned idx = tail & *sq_mask;
+    io_uring_sqe* sqe = &sqes[idx];
+    std::memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = file_fd;
+    sqe->off = offset;
+    sqe->addr = reinterpret_cast<uint64_t>(bytes);
+    sqe->len = n;
+    sqe->user_data = user_data;
+    sq_array[idx] = idx;
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ++to_submit;
+    return true;
+}
+
+// hands every queued read to the kernel with one syscall, false leaves the reads it did not take queued
+bool Uring::submit() {
+    while (to_submit != 0) {
+        int r = syscall(__NR_io_uring_enter, fd, to_submit, 0, 0, nullptr, 0);
+        if (r < 0 && errno == EINTR) {
+            continue;
+        }
+        if (r <= 0) {
+            return false;
+        }
+        to_submit -= r;
+    }
+    return true;
+}
+
+// takes back the reads the kernel has not consumed, they will never complete
+void Uring::drop_unsubmitted(std::vector<uint64_t>* user_data) {
+    unsigned head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+    for (unsigned i = head; i != *sq_tail; ++i) {
+        user_data->push_back(sqes[sq_array[i & *sq_mask]].user_data);
+    }
+    __atomic_store_n(sq_tail, head, __ATOMIC_RELEASE);
+    to_submit = 0;
+}
+
+// takes one completion, false when there is none and wait is off
+bool Uring::pop(uint64_t* user_data, int32_t* res, bool wait) {
+    unsigned head = *cq_head;
+    while (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+        if (!wait) {
+            return false;
+        }
+        int r = syscall(__NR_io_uring_enter, fd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+        if (r < 0 && errno != EINTR) {
+            return false;
+        }
+    }
+    io_uring_cqe* cqe = &cqes[head & *cq_mask];
+    *user_data = cqe->user_data;
+    *res = cqe->res;
+    __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+#else
+
+bool Uring::init(unsigned) { return false; }
+void Uring::close() { }
+bool Uring::push_read(int, uint64_t, uint8_t*, uint32_t, uint64_t) { return false; }
+bool Uring::submit() { return false; }
+void Uring::drop_unsubmitted(std::vector<uint64_t>*) { }
+bool Uring::pop(uint64_t*, int32_t*, bool) { return false; }
+
+#endif
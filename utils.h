@@ -18,7 +18,7 @@ uint8_t get_n_bytes_in_varint(uint64_t v);
 
 void print_binary(uint64_t v);
 void print_binary(uint8_t v);
-void print_bytes(uint8_t* start, uint8_t* end, char last = '\n');
+void print_bytes(const uint8_t* start, const uint8_t* end, char last = '\n');
 void print_uint8_t(uint8_t v, char last = '\n');
 
 int8_t read_int8(const uint8_t* bytes);
@@ -112,7 +112,7 @@ void print_uint8_t(uint8_t v, char last) {
     std::cout << static_cast<int>(v) << last;
 }
 
-void print_bytes(uint8_t* start, uint8_t* end, char last) {
+void print_bytes(const uint8_t* start, const uint8_t* end, char last) {
     while (start != end) {
         std::cout << *start;
         ++start;
@@ -0,0 +1,277 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/file.h>
+#include <climits>
+#include <cerrno>
+#include <memory>
+#include <shared_mutex>
+
+// Everything the database and its log do with files goes through a VFS
+// PosixVfs works on real files with positional reads and writes only, there is no shared file cursor,
+// so any number of threads can read pages at the same time
+// MemoryVfs keeps whole files in memory, ":memory:" databases get a private one
+
+enum class LockType {
+    Shared,
+    Exclusive
+};
+
+struct VfsFile {
+    virtual ~VfsFile() { }
+
+    // reading past the end of file fills the rest with zeros and returns false
+    virtual bool read(uint64_t offset, uint8_t* bytes, size_t n) = 0;
+    // scatter read of one contiguous range, iov is consumed, false on a short read
+    virtual bool read(uint64_t offset, iovec* iov, int iov_n) = 0;
+    virtual bool write(uint64_t offset, const uint8_t* bytes, size_t n) = 0;
+    virtual uint64_t size() = 0;
+    virtual bool sync() = 0;
+    virtual bool truncate(uint64_t size) = 0;
+    // never waits, false when somebody else holds a conflicting lock
+    virtual bool lock(LockType type) = 0;
+    virtual void unlock() = 0;
+    // asks for the range to be read in the background
+    virtual void prefetch(uint64_t, uint64_t) { }
+    // files without a descriptor can't be mapped or read through io_uring
+    virtual int get_fd() { return -1; }
+};
+
+struct Vfs {
+    virtual ~Vfs() { }
+
+    virtual std::unique_ptr<VfsFile> open(const std::string& fn, bool create = false) = 0;
+    virtual bool exists(const std::string& fn) = 0;
+    virtual bool remove(const std::string& fn) = 0;
+};
+
+struct PosixFile: VfsFile {
+    int fd;
+
+    PosixFile(int fd): fd(fd) { }
+    ~PosixFile() { ::close(fd); }
+
+    bool read(uint64_t offset, uint8_t* bytes, size_t n) override;
+    bool read(uint64_t offset, iovec* iov, int iov_n) override;
+    bool write(uint64_t offset, const uint8_t* bytes, size_t n) override;
+    uint64_t size() override;
+    bool sync() override;
+    bool truncate(uint64_t size) override;
+    bool lock(LockType type) override;
+    void unlock() override;
+    void prefetch(uint64_t offset, uint64_t n) override;
+    int get_fd() override { return fd; }
+};
+
+struct PosixVfs: Vfs {
+    std::unique_ptr<VfsFile> open(const std::string& fn, bool create = false) override;
+    bool exists(const std::string& fn) override { return std::filesystem::exists(fn); }
+    bool remove(const std::string& fn) override { return std::filesystem::remove(fn); }
+};
+
+static PosixVfs DEFAULT_VFS;
+
+std::unique_ptr<VfsFile> PosixVfs::open(const std::string& fn, bool create) {
+    int fd = ::open(fn.c_str(), create ? O_RDWR | O_CREAT : O_RDWR, 0644);
+    if (fd == -1) {
+        return nullptr;
+    }
+    return std::make_unique<PosixFile>(fd);
+}
+
+bool PosixFile::read(uint64_t offset, uint8_t* bytes, size_t n) {
+    size_t done = 0;
+    while (done < n) {
+        ssize_t r = ::pread(fd, bytes + done, n - done, offset + done);
+        if (r < 0 && errno == EINTR) {
+            continue;
+        }
+        if (r <= 0) {
+            std::memset(bytes + done, 0, n - done);
+            return false;
+        }
+        done += r;
+    }
+    return true;
+}
+
+bool PosixFile::read(uint64_t offset, iovec* iov, int iov_n) {
+    while (iov_n > 0) {
+        ssize_t r = ::preadv(fd, iov, std::min(iov_n, IOV_MAX), offset);
+        if (r < 0 && errno == EINTR) {
+            continue;
+        }
+        if (r <= 0) {
+            return false;
+        }
+        offset += r;
+        while (iov_n > 0 && static_cast<size_t>(r) >= iov->iov_len) {
+            r -= iov->iov_len;
+            ++iov;
+            --iov_n;
+        }
+        if (iov_n > 0) {
+            iov->iov_base = static_cast<uint8_t*>(iov->iov_base) + r;
+            iov->iov_len -= r;
+        }
+    }
+    return true;
+}
+
+bool PosixFile::write(uint64_t offset, const uint8_t* bytes, size_t n) {
+    size_t done = 0;
+    while (done < n) {
+        ssize_t r = ::pwrite(fd, bytes + done, n - done, offset + done);
+        if (r < 0 && errno == EINTR) {
+            continue;
+        }
+        if (r <= 0) {
+            std::cerr << "page write failed\n";
+            return false;
+        }
+        done += r;
+    }
+    return true;
+}
+
+uint64_t PosixFile::size() {
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        return 0;
+    }
+    return st.st_size;
+}
+
+bool PosixFile::sync() {
+    return fdatasync(fd) == 0;
+}
+
+bool PosixFile::truncate(uint64_t size) {
+    return ftruncate(fd, size) == 0;
+}
+
+// flock locks belong to the open file, so two DB objects of one process exclude each other too
+bool PosixFile::lock(LockType type) {
+    int r;
+    do {
+        r = flock(fd, (type == LockType::Exclusive ? LOCK_EX : LOCK_SH) | LOCK_NB);
+    } while (r == -1 && errno == EINTR);
+    return r == 0;
+}
+
+void PosixFile::unlock() {
+    flock(fd, LOCK_UN);
+}
+
+void PosixFile::prefetch(uint64_t offset, uint64_t n) {
+    posix_fadvise(fd, offset, n, POSIX_FADV_WILLNEED);
+}
+
+// Memory files are shared by everybody who opens the same name in one MemoryVfs
+// Locks are no-ops, a MemoryVfs is private to one process and the callers serialize writes already
+
+struct MemoryFile: VfsFile {
+    struct Data {
+        std::vector<uint8_t> bytes;
+        std::shared_mutex mutex; // writes may grow the vector while page cache misses read
+    };
+
+    std::shared_ptr<Data> data;
+
+    MemoryFile(std::shared_ptr<Data> data): data(data) { }
+
+    bool read(uint64_t offset, uint8_t* bytes, size_t n) override;
+    bool read(uint64_t offset, iovec* iov, int iov_n) override;
+    bool write(uint64_t offset, const uint8_t* bytes, size_t n) override;
+    uint64_t size() override;
+    bool sync() override { return true; }
+    bool truncate(uint64_t size) override;
+    bool lock(LockType) override { return true; }
+    void unlock() override { }
+};
+
+struct MemoryVfs: Vfs {
+    std::map<std::string, std::shared_ptr<MemoryFile::Data>> files;
+    std::mutex mutex;
+
+    std::unique_ptr<VfsFile> open(const std::string& fn, bool create = false) override;
+    bool exists(const std::string& fn) override;
+    bool remove(const std::string& fn) override;
+    bool load(const std::string& fn, const std::string& path);
+};
+
+bool MemoryFile::read(uint64_t offset, uint8_t* bytes, size_t n) {
+    std::shared_lock<std::shared_mutex> lock(data->mutex);
+    size_t available = offset < data->bytes.size() ? std::min<uint64_t>(n, data->bytes.size() - offset) : 0;
+    if (available != 0) {
+        std::memcpy(bytes, data->bytes.data() + offset, available);
+    }
+    std::memset(bytes + available, 0, n - available);
+    return available == n;
+}
+
+bool MemoryFile::read(uint64_t offset, iovec* iov, int iov_n) {
+    bool ok = true;
+    for (int i = 0; i < iov_n; ++i) {
+        ok = read(offset, static_cast<uint8_t*>(iov[i].iov_base), iov[i].iov_len) && ok;
+        offset += iov[i].iov_len;
+    }
+    return ok;
+}
+
+bool MemoryFile::write(uint64_t offset, const uint8_t* bytes, size_t n) {
+    std::unique_lock<std::shared_mutex> lock(data->mutex);
+    if (offset + n > data->bytes.size()) {
+        data->bytes.resize(offset + n);
+    }
+    std::memcpy(data->bytes.data() + offset, bytes, n);
+    return true;
+}
+
+uint64_t MemoryFile::size() {
+    std::shared_lock<std::shared_mutex> lock(data->mutex);
+    return data->bytes.size();
+}
+
+bool MemoryFile::truncate(uint64_t size) {
+    std::unique_lock<std::shared_mutex> lock(data->mutex);
+    data->bytes.resize(size);
+    return true;
+}
+
+std::unique_ptr<VfsFile> MemoryVfs::open(const std::string& fn, bool create) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = files.find(fn);
+    if (it == files.end()) {
+        if (!create) {
+            return nullptr;
+        }
+        it = files.emplace(fn, std::make_shared<MemoryFile::Data>()).first;
+    }
+    return std::make_unique<MemoryFile>(it->second);
+}
+
+bool MemoryVfs::exists(const std::string& fn) {
+    std::lock_guard<std::mutex> lock(mutex);
+    return files.count(fn) != 0;
+}
+
+// open files keep their data, the name is free for a new file at once
+bool MemoryVfs::remove(const std::string& fn) {
+    std::lock_guard<std::mutex> lock(mutex);
+    return files.erase(fn) != 0;
+}
+
+// copies a file from disk, e.g. to run a database entirely from memory
+bool MemoryVfs::load(const std::string& fn, const std::string& path) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) {
+        return false;
+    }
+    auto data = std::make_shared<MemoryFile::Data>();
+    data->bytes.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    std::lock_guard<std::mutex> lock(mutex);
+    files[fn] = data;
+    return true;
+}
@@ -0,0 +1,218 @@
+#include <unordered_map>
+#include <random>
+
+// Write-ahead log in the SQLite WAL file format
+//
+// 32 bytes header: magic, format version, page size, checkpoint sequence, salt-1, salt-2, checksum-1, checksum-2
+// then frames: 24 bytes frame header (page number, database size in pages for commit frames or zero,
+// salt-1, salt-2, checksum-1, checksum-2) followed by the page image
+//
+// Checksums are cumulative over the whole file, so on open only the frames up to the last
+// commit frame with a valid checksum chain are taken into the wal-index
+
+static const uint32_t WAL_MAGIC = 0x377f0683; // big-endian checksums
+static const uint32_t WAL_FORMAT_VERSION = 3007000;
+static const uint32_t WAL_HEADER_SIZE = 32;
+static const uint32_t WAL_FRAME_HEADER_SIZE = 24;
+static const uint32_t WAL_AUTOCHECKPOINT = 1000; // frames
+
+struct Wal {
+    std::unique_ptr<VfsFile> file;
+    uint32_t page_size = 0;
+    uint32_t checkpoint_seq = 0;
+    uint32_t salt[2] = {0, 0};
+    uint32_t checksum[2] = {0, 0};        // running checksum after the last appended frame
+    uint32_t commit_checksum[2] = {0, 0}; // running checksum after the last commit frame
+    uint32_t n_frames = 0;
+    uint32_t n_committed_frames = 0;
+    uint32_t db_size = 0; // database size in pages from the last commit frame
+    std::unordered_map<uint32_t, uint32_t> index;   // page number -> newest committed frame
+    std::unordered_map<uint32_t, uint32_t> pending; // page number -> newest frame of the open write
+
+    bool open(Vfs* vfs, const std::string& fn, uint32_t page_size);
+    void close() { file.reset(); }
+    bool is_open() { return file != nullptr; }
+    uint32_t find(uint32_t pg_n);
+    bool read_frame(uint32_t frame, uint8_t* bytes);
+    bool append(uint32_t pg_n, const uint8_t* bytes, uint32_t commit_db_size);
+    void rollback();
+    bool reset();
+    bool recover();
+    uint64_t frame_offset(uint32_t frame) { return WAL_HEADER_SIZE + static_cast<uint64_t>(frame - 1) * (WAL_FRAME_HEADER_SIZE + page_size); }
+    static void compute_checksum(const uint8_t* bytes, size_t n, uint32_t* s);
+};
+
+void Wal::compute_checksum(const uint8_t* bytes, size_t n, uint32_t* s) {
+    uint32_t s1 = s[0], s2 = s[1];
+    uint32_t x0, x1;
+    for (size_t i = 0; i < n; i += 8) {
+        read_big_endian32(&x0, bytes + i);
+        read_big_endian32(&x1, bytes + i + 4);
+        s1 += x0 + s2;
+        s2 += x1 + s1;
+    }
+    s[0] = s1;
+    s[1] = s2;
+}
+
+// opens existing log and recovers committed frames or creates an empty one
+bool Wal::open(Vfs* vfs, const std::string& fn, uint32_t page_size) {
+    this->page_size = page_size;
+    file = vfs->open(fn, true);
+    if (file == nullptr) {
+        std::cerr << "cannot open wal file " << fn << "\n";
+        return false;
+    }
+    if (file->size() >= WAL_HEADER_SIZE && recover()) {
+        return true;
+    }
+    return reset();
+}
+
+bool Wal::recover() {
+    uint8_t header[WAL_HEADER_SIZE];
+    uint32_t magic, version, wal_page_size, header_checksum[2];
+    file->read(0, header, WAL_HEADER_SIZE);
+    read_big_endian32(&magic, header);
+    read_big_endian32(&version, header + 4);
+    read_big_endian32(&wal_page_size, header + 8);
+    read_big_endian32(&checkpoint_seq, header + 12);
+    read_big_endian32(&salt[0], header + 16);
+    read_big_endian32(&salt[1], header + 20);
+    read_big_endian32(&header_checksum[0], header + 24);
+    read_big_endian32(&header_checksum[1], header + 28);
+
+    checksum[0] = checksum[1] = 0;
+    compute_checksum(header, 24, checksum);
+    if (magic != WAL_MAGIC || version != WAL_FORMAT_VERSION || wal_page_size != page_size ||
+        checksum[0] != header_checksum[0] || checksum[1] != header_checksum[1]) {
+        return false;
+    }
+    commit_checksum[0] = checksum[0];
+    commit_checksum[1] = checksum[1];
+
+    uint8_t* frame = new uint8_t[WAL_FRAME_HEADER_SIZE + page_size];
+    uint64_t size = file->size();
+    uint32_t pg_n, commit_db_size, frame_salt[2], frame_checksum[2];
+    index.clear();
+    pending.clear();
+    n_frames = n_committed_frames = 0;
+
+    for (uint32_t i = 1; frame_offset(i) + WAL_FRAME_HEADER_SIZE + page_size <= size; ++i) {
+        file->read(frame_offset(i), frame, WAL_FRAME_HEADER_SIZE + page_size);
+        read_big_endian32(&pg_n, frame);
+        read_big_endian32(&commit_db_size, frame + 4);
+        read_big_endian32(&frame_salt[0], frame + 8);
+        read_big_endian32(&frame_salt[1], frame + 12);
+        read_big_endian32(&frame_checksum[0], frame + 16);
+        read_big_endian32(&frame_checksum[1], frame + 20);
+        if (pg_n == 0 || frame_salt[0] != salt[0] || frame_salt[1] != salt[1]) {
+            break;
+        }
+        compute_checksum(frame, 8, checksum);
+        compute_checksum(frame + WAL_FRAME_HEADER_SIZE, page_size, checksum);
+        if (checksum[0] != frame_checksum[0] || checksum[1] != frame_checksum[1]) {
+            break;
+        }
+        pending[pg_n] = i;
+        if (commit_db_size != 0) {
+            for (auto& pair : pending) {
+                index[pair.first] = pair.second;
+            }
+            pending.clear();
+            n_committed_frames = i;
+            db_size = commit_db_size;
+            commit_checksum[0] = checksum[0];
+            commit_checksum[1] = checksum[1];
+        }
+    }
+    delete[] frame;
+
+    // frames after the last commit never happened
+    rollback();
+    return true;
+}
+
+// newest frame holding the page, own uncommitted frames included, 0 if the page is not in the log
+uint32_t Wal::find(uint32_t pg_n) {
+    auto it = pending.find(pg_n);
+    if (it != pending.end()) {
+        return it->second;
+    }
+    it = index.find(pg_n);
+    if (it != index.end()) {
+        return it->second;
+    }
+    return 0;
+}
+
+bool Wal::read_frame(uint32_t frame, uint8_t* bytes) {
+    return file->read(frame_offset(frame) + WAL_FRAME_HEADER_SIZE, bytes, page_size);
+}
+
+// commit_db_size != 0 makes this a commit frame: everything appended since the previous commit becomes visible after a crash
+bool Wal::append(uint32_t pg_n, const uint8_t* bytes, uint32_t commit_db_size) {
+    uint8_t* frame = new uint8_t[WAL_FRAME_HEADER_SIZE + page_size];
+    write_big_endian32(pg_n, frame);
+    write_big_endian32(commit_db_size, frame + 4);
+    write_big_endian32(salt[0], frame + 8);
+    write_big_endian32(salt[1], frame + 12);
+    std::memcpy(frame + WAL_FRAME_HEADER_SIZE, bytes, page_size);
+    compute_checksum(frame, 8, checksum);
+    compute_checksum(frame + WAL_FRAME_HEADER_SIZE, page_size, checksum);
+    write_big_endian32(checksum[0], frame + 16);
+    write_big_endian32(checksum[1], frame + 20);
+
+    ++n_frames;
+    bool ok = file->write(frame_offset(n_frames), frame, WAL_FRAME_HEADER_SIZE + page_size);
+    delete[] frame;
+
+    pending[pg_n] = n_frames;
+    if (commit_db_size != 0) {
+        for (auto& pair : pending) {
+            index[pair.first] = pair.second;
+        }
+        pending.clear();
+        n_committed_frames = n_frames;
+        db_size = commit_db_size;
+        commit_checksum[0] = checksum[0];
+        commit_checksum[1] = checksum[1];
+    }
+    return ok;
+}
+
+// forgets frames appended after the last commit, they get overwritten by the next append
+void Wal::rollback() {
+    pending.clear();
+    n_frames = n_committed_frames;
+    checksum[0] = commit_checksum[0];
+    checksum[1] = commit_checksum[1];
+}
+
+// starts an empty log with new salts, called after every frame was checkpointed
+bool Wal::reset() {
+    static std::mt19937 rng(std::random_device{}());
+    ++checkpoint_seq;
+    salt[0] += 1;
+    salt[1] = rng();
+
+    uint8_t header[WAL_HEADER_SIZE];
+    write_big_endian32(WAL_MAGIC, header);
+    write_big_endian32(WAL_FORMAT_VERSION, header + 4);
+    write_big_endian32(page_size, header + 8);
+    write_big_endian32(checkpoint_seq, header + 12);
+    write_big_endian32(salt[0], header + 16);
+    write_big_endian32(salt[1], header + 20);
+    checksum[0] = checksum[1] = 0;
+    compute_checksum(header, 24, checksum);
+    write_big_endian32(checksum[0], header + 24);
+    write_big_endian32(checksum[1], header + 28);
+    commit_checksum[0] = checksum[0];
+    commit_checksum[1] = checksum[1];
+
+    index.clear();
+    pending.clear();
+    n_frames = n_committed_frames = 0;
+    db_size = 0;
+    return file->truncate(0) && file->write(0, header, WAL_HEADER_SIZE);
+}